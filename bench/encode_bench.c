@@ -0,0 +1,92 @@
+/**
+ * @file encode_bench.c
+ *
+ * @brief Compares the template event encoder with the ei based one.
+ *
+ * Checks that both encoders produce identical bytes and reports the time
+ * per event.  Build and run with `make bench'.
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <time.h>
+
+#include "encode.h"
+
+#define ITERATIONS 5000000
+
+typedef int (*encode_fn) (char *, size_t, int, uint32_t, uint32_t,
+                          const char *, uint32_t, const struct statx *, uint64_t);
+
+static const char *names[] = {
+    "", "a", "file.txt", "some-longer-file-name.tar.gz",
+    "very/long/name/that/is/not/really/valid/but/tests/longer/strings/ok",
+};
+#define NNAMES (sizeof (names) / sizeof (names[0]))
+
+static double
+now (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double
+run (encode_fn fn, char *buf, size_t sz)
+{
+    unsigned long sum = 0;
+    double t = now ();
+
+    for (unsigned int i = 0; i < ITERATIONS; i++) {
+        const char *name = names[i % NNAMES];
+        sum += fn (buf, sz, i & 0xffff, IN_MODIFY, i, name, strlen (name), NULL, i);
+    }
+
+    t = now () - t;
+    if (sum == 0)
+        abort ();
+
+    return t * 1e9 / ITERATIONS;
+}
+
+int
+main (void)
+{
+    char a[ENCODE_EVENT_MAX], b[ENCODE_EVENT_MAX];
+
+    if (encode_init () != 0) {
+        fprintf (stderr, "fast encoder disabled\n");
+        return EXIT_FAILURE;
+    }
+
+    /* verify */
+    static const uint32_t ints[] = {
+        0, 1, 255, 256, 65535, 65536, 1U << 27, 0x7fffffff, 0xffffffff,
+    };
+    for (size_t i = 0; i < sizeof (ints) / sizeof (ints[0]); i++) {
+        for (size_t j = 0; j < NNAMES; j++) {
+            uint32_t len = strlen (names[j]);
+            int na = encode_event (a, sizeof (a), ints[i], ints[i], ints[i],
+                                   names[j], len, NULL, ints[i]);
+            int nb = encode_event_ei (b, sizeof (b), ints[i], ints[i], ints[i],
+                                      names[j], len, NULL, ints[i]);
+            if (na != nb || memcmp (a, b, na) != 0) {
+                fprintf (stderr, "mismatch: %u '%s'\n", ints[i], names[j]);
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    double ei = run (&encode_event_ei, b, sizeof (b));
+    double fast = run (&encode_event, a, sizeof (a));
+
+    printf ("ei:       %6.1f ns/event\n", ei);
+    printf ("template: %6.1f ns/event\n", fast);
+    printf ("speedup:  %6.2fx\n", ei / fast);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,289 @@
+/**
+ * @file budget.c
+ *
+ * @brief Watch budget with LRU eviction.
+ *
+ * The number of inotify watches is limited by fs.inotify.max_user_watches
+ * (shared by all processes of the user).  Watches added with `evictable' or
+ * `ttl' options (by all their subscribers) are kept in a chain ordered by
+ * last activity.  When a new
+ * watch exceeds the budget, or inotify_add_watch() fails with ENOSPC, the
+ * least recently active ones are removed to make room.  Watches with a TTL
+ * are also removed after being idle for TTL seconds.  The owner gets
+ * #einotify_evicted{} for every removed watch.
+ *
+ * The budget is compared with the watches of this process only.  The default
+ * (max_user_watches) also counts watches of other processes of the user, so
+ * with those the kernel limit is usually hit first; that is handled through
+ * ENOSPC.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#define _GNU_SOURCE /* for TEMP_FAILURE_RETRY */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "budget.h"
+#include "chain.h"
+#include "control.h"
+#include "log.h"
+#include "watch.h"
+
+#define MAX_USER_WATCHES "/proc/sys/fs/inotify/max_user_watches"
+/* used if the limit can not be read */
+#define DEFAULT_BUDGET 8192
+/* TTL check period (seconds) */
+#define PERIOD 1
+
+struct budget {
+    /* LRU chain, most recently active first */
+    struct budget *prev;
+    struct budget *next;
+    struct watch  *w;
+    uint64_t      last;
+    unsigned int  ttl;
+};
+
+static struct evl_handler *eh = NULL;
+static struct budget *lru = NULL;
+static struct budget *lru_tail = NULL;
+static unsigned int nlru = 0;
+static unsigned int nttl = 0;
+static unsigned long limit = 0;
+static unsigned long evicted = 0;
+
+static inline uint64_t
+now_sec (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+static void
+timer_set (int on)
+{
+    struct itimerspec its;
+
+    memset (&its, 0, sizeof (its));
+    if (on) {
+        its.it_value.tv_sec = PERIOD;
+        its.it_interval     = its.it_value;
+    }
+
+    if (timerfd_settime (eh->fd, 0, &its, NULL) == -1)
+        ERR ("timerfd_settime: %s", strerror (errno));
+}
+
+static unsigned long
+read_limit (void)
+{
+    unsigned long val = 0;
+
+    FILE *f = fopen (MAX_USER_WATCHES, "r");
+    if (f == NULL || fscanf (f, "%lu", &val) != 1 || val == 0) {
+        WARNING ("can not read " MAX_USER_WATCHES ", assuming %d", DEFAULT_BUDGET);
+        val = DEFAULT_BUDGET;
+    }
+    if (f != NULL)
+        fclose (f);
+
+    return val;
+}
+
+static inline void
+lru_del (struct budget *b)
+{
+    if (lru_tail == b)
+        lru_tail = b->prev;
+    chain_del (lru, b);
+}
+
+static inline void
+lru_add (struct budget *b)
+{
+    chain_add (lru, b);
+    if (lru_tail == NULL)
+        lru_tail = b;
+}
+
+/* Removes the watch for all subscribers (frees `b'). */
+static void
+evict (struct budget *b, const char *reason)
+{
+    struct watch *w = b->w;
+
+    DEBUG ("%s: wd %d (%s): %s", __func__, w->wd, w->path, reason);
+    control_evicted (w->wd, w->path, reason);
+    evicted++;
+
+    if (watch_remove (w) == -1)
+        WARNING ("inotify_rm_watch (%d): %s", w->wd, strerror (errno));
+}
+
+static void
+budget_handler (struct evl_handler *eh, uint32_t _events, void *_nil)
+{
+    uint64_t cnt;
+    struct budget *b, *next;
+
+    if (TEMP_FAILURE_RETRY (read (eh->fd, &cnt, sizeof (cnt))) == -1) {
+        if (errno != EAGAIN)
+            ERR ("read (timerfd): %s", strerror (errno));
+        return;
+    }
+
+    uint64_t now = now_sec ();
+
+    chain_for_each_safe (lru, b, next) {
+        if (b->ttl && now - b->last >= b->ttl)
+            evict (b, "ttl");
+    }
+}
+
+int
+budget_init (struct evl_inst *loop)
+{
+    assert (eh == NULL);
+
+    int tfd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (tfd == -1) {
+        ERR ("timerfd_create: %s", strerror (errno));
+        return -1;
+    }
+
+    eh = evl_add (loop, tfd, EPOLLIN, &budget_handler, NULL);
+    assert (eh != NULL);
+
+    limit = read_limit ();
+
+    return 0;
+}
+
+void
+budget_destroy (struct evl_inst *loop)
+{
+    if (eh != NULL) {
+        evl_del (loop, eh);
+        TEMP_FAILURE_RETRY (close (eh->fd));
+        eh = NULL;
+    }
+}
+
+/**
+ * Makes the watch @a w evictable; with non-zero @a ttl it is also removed
+ * after @a ttl seconds without events.
+ */
+struct budget *
+budget_new (struct watch *w, unsigned int ttl)
+{
+    struct budget *b = calloc (1, sizeof (*b));
+    assert (b != NULL);
+
+    b->w    = w;
+    b->ttl  = ttl;
+    b->last = now_sec ();
+    lru_add (b);
+    nlru++;
+
+    if (ttl && nttl++ == 0)
+        timer_set (1);
+
+    return b;
+}
+
+void
+budget_free (struct budget *b)
+{
+    lru_del (b);
+    nlru--;
+
+    if (b->ttl && --nttl == 0)
+        timer_set (0);
+
+    free (b);
+}
+
+unsigned int
+budget_ttl (const struct budget *b)
+{
+    return b->ttl;
+}
+
+/* Records activity of the watch. */
+void
+budget_touch (struct budget *b)
+{
+    b->last = now_sec ();
+    if (lru != b) {
+        lru_del (b);
+        lru_add (b);
+    }
+}
+
+/* Evicts up to `n' least recently active watches other than `keep'. */
+static int
+evict_lru (int n, const struct watch *keep)
+{
+    struct budget *b = lru_tail;
+    int i = 0;
+
+    while (i < n && b != NULL) {
+        struct budget *prev = b->prev;
+        if (b->w != keep) {
+            evict (b, "limit");
+            i++;
+        }
+        b = prev;
+    }
+
+    return i;
+}
+
+/**
+ * Evicts up to @a n least recently active watches (the kernel limit was hit).
+ *
+ * @return number of evicted watches
+ */
+int
+budget_evict (int n)
+{
+    return evict_lru (n, NULL);
+}
+
+/**
+ * Evicts watches other than the new watch @a w while the budget is exceeded.
+ */
+void
+budget_check (const struct watch *w)
+{
+    unsigned int count = watch_count ();
+
+    if (count > limit)
+        evict_lru (count - limit, w);
+}
+
+/* Sets the budget, 0 means fs.inotify.max_user_watches. */
+void
+budget_set_limit (unsigned long val)
+{
+    limit = val ? val : read_limit ();
+}
+
+void
+budget_get_stats (struct budget_stats *st)
+{
+    st->limit     = limit;
+    st->watches   = watch_count ();
+    st->evictable = nlru;
+    st->evicted   = evicted;
+}
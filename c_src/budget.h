@@ -0,0 +1,46 @@
+#ifndef _BUDGET_H
+#define _BUDGET_H
+
+#include "evl.h"
+
+struct budget;
+struct watch;
+
+struct budget_stats {
+    unsigned long limit;
+    unsigned long watches;
+    unsigned long evictable;
+    unsigned long evicted;
+};
+
+extern int
+budget_init (struct evl_inst *loop);
+
+extern void
+budget_destroy (struct evl_inst *loop);
+
+extern struct budget *
+budget_new (struct watch *w, unsigned int ttl);
+
+extern void
+budget_free (struct budget *b);
+
+extern unsigned int
+budget_ttl (const struct budget *b);
+
+extern void
+budget_touch (struct budget *b);
+
+extern int
+budget_evict (int n);
+
+extern void
+budget_check (const struct watch *w);
+
+extern void
+budget_set_limit (unsigned long val);
+
+extern void
+budget_get_stats (struct budget_stats *st);
+
+#endif /* _BUDGET_H */
@@ -0,0 +1,533 @@
+/**
+ * @file checkpoint.c
+ *
+ * @brief Checkpoint of the watch set for rehydration after a restart.
+ *
+ * Watches added and removed by the owner are appended to a log file with
+ * their options and the mtime of the watched path; paths with events get
+ * their mtime refreshed after a short delay, once the owner's output is
+ * written out (a restart must not take undelivered events as seen).
+ * Records are buffered and written at the end of the loop iteration.  When
+ * the log holds many more records than there are watches it is compacted:
+ * rewritten from the watch table and renamed over the old one.
+ *
+ * A port started with an existing checkpoint re-adds the watches and tells
+ * the owner for every path whether its mtime changed meanwhile, so only
+ * those have to be rescanned.  A torn record at the end (crash during a
+ * write) is ignored.  After a failed write nothing more is appended: the
+ * file is rewritten from the watch table instead (retried every REFRESH
+ * seconds while it fails).
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#define _GNU_SOURCE /* for TEMP_FAILURE_RETRY */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "checkpoint.h"
+#include "control.h"
+#include "log.h"
+#include "watch.h"
+
+#define CKPT_MAGIC   0x65696e63 /* "einc" */
+#define CKPT_VERSION 1
+/* mtime refresh delay for paths with events, rewrite retry period (seconds) */
+#define REFRESH 1
+/* records allowed above twice the number of watches before compaction */
+#define SLACK 1024
+
+enum {
+    OP_ADD = 1,
+    OP_RM
+};
+
+struct hdr {
+    uint32_t magic;
+    uint32_t version;
+};
+
+/* followed by the path with terminating zero */
+struct rec {
+    uint32_t len; /* including the path */
+    uint32_t op;
+    uint32_t mask;
+    uint32_t flags;
+    int32_t  prio;
+    uint32_t rate;
+    uint32_t burst;
+    uint32_t names;
+    uint32_t evictable;
+    uint32_t ttl;
+    int64_t  mtime_sec;
+    int64_t  mtime_nsec;
+};
+
+struct buf {
+    char   *data;
+    size_t len;
+    size_t cap;
+};
+
+static struct evl_handler *eh = NULL;
+static char *file = NULL;
+static int fd = -1;
+/* records not written yet */
+static struct buf pending;
+static unsigned long npending = 0;
+static unsigned long nrecs = 0;
+/* the file lost records (failed write), it is rewritten by compact() */
+static int rewrite = 0;
+/* watches with events since their last record */
+static int *dirty = NULL;
+static size_t ndirty = 0;
+static size_t cdirty = 0;
+/* file contents and offsets of the live records (until restored) */
+static char *fdata = NULL;
+static size_t *live = NULL;
+static size_t nlive = 0;
+
+static void
+buf_add (struct buf *b, const void *data, size_t len)
+{
+    if (b->len + len > b->cap) {
+        b->cap = b->cap ? b->cap : 4096;
+        while (b->cap < b->len + len)
+            b->cap *= 2;
+        b->data = realloc (b->data, b->cap);
+        assert (b->data != NULL);
+    }
+
+    memcpy (b->data + b->len, data, len);
+    b->len += len;
+}
+
+static int
+write_all (int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = TEMP_FAILURE_RETRY (write (fd, data, len));
+        if (n == -1)
+            return -1;
+        data += n;
+        len  -= n;
+    }
+
+    return 0;
+}
+
+/* Appends record of the watch (`op' is OP_ADD or OP_RM). */
+static int
+rec_add (struct buf *b, const struct watch *w, uint32_t op)
+{
+    struct watch_opts opts;
+    const struct sub *s = watch_sub (w, control_owner ());
+
+    if (s == NULL)
+        return 0;
+
+    watch_get_opts (s, &opts);
+
+    size_t plen = strlen (w->path) + 1;
+    struct rec r = {
+        .len        = sizeof (r) + plen,
+        .op         = op,
+        .mask       = s->mask,
+        .flags      = opts.flags,
+        .prio       = opts.prio,
+        .rate       = opts.rate,
+        .burst      = opts.burst,
+        .names      = opts.names,
+        .evictable  = opts.evictable,
+        .ttl        = opts.ttl,
+        .mtime_sec  = w->mtime.tv_sec,
+        .mtime_nsec = w->mtime.tv_nsec,
+    };
+    buf_add (b, &r, sizeof (r));
+    buf_add (b, w->path, plen);
+
+    return 1;
+}
+
+static void
+timer_set (void);
+
+static void
+compact_add (struct watch *w, void *arg)
+{
+    nrecs += rec_add (arg, w, OP_ADD);
+}
+
+/* Makes the rename of the file durable. */
+static void
+sync_dir (void)
+{
+    char dir[PATH_MAX];
+    const char *slash = strrchr (file, '/');
+
+    if (slash == NULL)
+        strcpy (dir, ".");
+    else
+        snprintf (dir, sizeof (dir), "%.*s", slash == file ? 1 : (int) (slash - file), file);
+
+    int dfd = open (dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd == -1 || fsync (dfd) == -1)
+        WARNING ("fsync (%s): %s", dir, strerror (errno));
+    if (dfd != -1)
+        TEMP_FAILURE_RETRY (close (dfd));
+}
+
+/* Rewrites the file from the watch table. */
+static void
+compact (void)
+{
+    struct hdr h = { CKPT_MAGIC, CKPT_VERSION };
+    struct buf b = { NULL, 0, 0 };
+    char tmp[PATH_MAX];
+
+    nrecs = 0;
+    buf_add (&b, &h, sizeof (h));
+    watch_for_each (&compact_add, &b);
+
+    /* pending records are in the table already */
+    pending.len = 0;
+    npending = 0;
+
+    snprintf (tmp, sizeof (tmp), "%s.tmp", file);
+    int tfd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (tfd == -1
+        || write_all (tfd, b.data, b.len) == -1
+        || fsync (tfd) == -1
+        || rename (tmp, file) == -1) {
+        WARNING ("checkpoint %s: %s", file, strerror (errno));
+        if (tfd != -1)
+            TEMP_FAILURE_RETRY (close (tfd));
+        unlink (tmp);
+        free (b.data);
+        /* the old file is still fine to append to unless it failed too */
+        rewrite = fd == -1;
+        if (rewrite)
+            timer_set ();
+        return;
+    }
+    TEMP_FAILURE_RETRY (close (tfd));
+    free (b.data);
+    sync_dir ();
+
+    if (fd != -1)
+        TEMP_FAILURE_RETRY (close (fd));
+    fd = open (file, O_WRONLY | O_APPEND | O_CLOEXEC);
+    rewrite = fd == -1;
+    if (rewrite) {
+        WARNING ("open (%s): %s", file, strerror (errno));
+        timer_set ();
+    }
+
+    DEBUG ("%s: %lu watches", __func__, nrecs);
+}
+
+static void
+timer_set (void)
+{
+    struct itimerspec its;
+
+    memset (&its, 0, sizeof (its));
+    its.it_value.tv_sec = REFRESH;
+
+    if (timerfd_settime (eh->fd, 0, &its, NULL) == -1)
+        ERR ("timerfd_settime: %s", strerror (errno));
+}
+
+/* Records the current mtime of watches with events, unless the owner may
+ * not have got the events yet (then it is retried later). */
+static void
+refresh (void)
+{
+    if (ndirty == 0)
+        return;
+
+    if (!control_owner_idle ()) {
+        timer_set ();
+        return;
+    }
+
+    for (size_t i = 0; i < ndirty; i++) {
+        struct watch *w = watch_get (dirty[i]);
+        if (w == NULL || !w->dirty)
+            continue;
+        w->dirty = 0;
+        if (!w->dead)
+            checkpoint_add (w);
+    }
+    ndirty = 0;
+}
+
+static void
+checkpoint_handler (struct evl_handler *eh, uint32_t _events, void *_nil)
+{
+    uint64_t cnt;
+
+    if (TEMP_FAILURE_RETRY (read (eh->fd, &cnt, sizeof (cnt))) == -1) {
+        if (errno != EAGAIN)
+            ERR ("read (timerfd): %s", strerror (errno));
+        return;
+    }
+
+    refresh ();
+    if (rewrite)
+        compact ();
+    else
+        checkpoint_flush ();
+}
+
+static int
+live_cmp (const void *a, const void *b)
+{
+    size_t oa = *(const size_t *) a, ob = *(const size_t *) b;
+    int rc = strcmp (fdata + oa + sizeof (struct rec), fdata + ob + sizeof (struct rec));
+
+    if (rc != 0)
+        return rc;
+    return oa < ob ? -1 : oa > ob;
+}
+
+/* Reads the file and finds the last record of every path. */
+static void
+load (int rfd)
+{
+    struct stat st;
+    struct hdr h;
+
+    if (fstat (rfd, &st) == -1 || st.st_size < (off_t) sizeof (h))
+        return;
+
+    fdata = malloc (st.st_size);
+    assert (fdata != NULL);
+
+    ssize_t n = TEMP_FAILURE_RETRY (pread (rfd, fdata, st.st_size, 0));
+    memcpy (&h, fdata, sizeof (h));
+    if (n != st.st_size || h.magic != CKPT_MAGIC || h.version != CKPT_VERSION) {
+        WARNING ("checkpoint %s: invalid, ignored", file);
+        return;
+    }
+
+    size_t size = n, off = sizeof (h), cap = 0;
+    while (off + sizeof (struct rec) < size) {
+        struct rec r;
+        memcpy (&r, fdata + off, sizeof (r));
+        if (r.len <= sizeof (r) || r.len > size - off || fdata[off + r.len - 1] != 0) {
+            WARNING ("checkpoint %s: torn record at %zu, ignored", file, off);
+            break;
+        }
+
+        if (nlive == cap) {
+            cap = cap ? cap * 2 : 1024;
+            live = realloc (live, cap * sizeof (*live));
+            assert (live != NULL);
+        }
+        live[nlive++] = off;
+        off += r.len;
+    }
+
+    /* keep the last record per path if it adds the watch */
+    qsort (live, nlive, sizeof (*live), &live_cmp);
+
+    size_t j = 0;
+    for (size_t i = 0; i < nlive; i++) {
+        const char *path = fdata + live[i] + sizeof (struct rec);
+        if (i + 1 < nlive && strcmp (path, fdata + live[i + 1] + sizeof (struct rec)) == 0)
+            continue;
+
+        struct rec r;
+        memcpy (&r, fdata + live[i], sizeof (r));
+        if (r.op == OP_ADD)
+            live[j++] = live[i];
+    }
+    nlive = j;
+}
+
+/**
+ * Enables checkpointing to @a path and loads the watches recorded there.
+ */
+int
+checkpoint_init (struct evl_inst *loop, const char *path)
+{
+    assert (eh == NULL);
+
+    int tfd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (tfd == -1) {
+        ERR ("timerfd_create: %s", strerror (errno));
+        return -1;
+    }
+
+    eh = evl_add (loop, tfd, EPOLLIN, &checkpoint_handler, NULL);
+    assert (eh != NULL);
+
+    file = strdup (path);
+    assert (file != NULL);
+
+    int rfd = open (path, O_RDONLY | O_CLOEXEC);
+    if (rfd == -1) {
+        if (errno != ENOENT)
+            WARNING ("open (%s): %s", path, strerror (errno));
+        return 0;
+    }
+
+    load (rfd);
+    TEMP_FAILURE_RETRY (close (rfd));
+
+    return 0;
+}
+
+/**
+ * Re-adds the loaded watches (if @a readd, otherwise the table is already
+ * filled, e.g. on handover) and starts a new log.  The owner gets
+ * #einotify_restored{} chunks, the last one possibly empty.
+ */
+void
+checkpoint_restore (int readd)
+{
+    assert (file != NULL);
+
+    struct checkpoint_res *res = calloc (nlive ? nlive : 1, sizeof (*res));
+    assert (res != NULL);
+
+    for (size_t i = 0; readd && i < nlive; i++) {
+        struct rec r;
+        memcpy (&r, fdata + live[i], sizeof (r));
+        char *path = fdata + live[i] + sizeof (r);
+
+        struct watch_opts opts = {
+            .flags     = r.flags,
+            .prio      = r.prio,
+            .rate      = r.rate,
+            .burst     = r.burst,
+            .names     = r.names,
+            .evictable = r.evictable,
+            .ttl       = r.ttl,
+        };
+
+        /* records the current mtime */
+        res[i].path = path;
+        res[i].wd   = watch_add (path, r.mask, &opts, control_owner ());
+        if (res[i].wd == -1) {
+            res[i].err = errno;
+            continue;
+        }
+
+        struct watch *w = watch_get (res[i].wd);
+        res[i].changed = w->mtime.tv_sec != r.mtime_sec || w->mtime.tv_nsec != r.mtime_nsec;
+    }
+
+    if (readd) {
+        DEBUG ("%s: %zu watches", __func__, nlive);
+        control_restored (res, nlive);
+    }
+
+    free (res);
+    free (live);
+    free (fdata);
+    live  = NULL;
+    fdata = NULL;
+    nlive = 0;
+
+    compact ();
+}
+
+/* Records added (or modified) watch with the current mtime of its path. */
+void
+checkpoint_add (struct watch *w)
+{
+    struct stat st;
+
+    if (file == NULL)
+        return;
+
+    if (stat (w->path, &st) == 0)
+        w->mtime = st.st_mtim;
+    else
+        memset (&w->mtime, 0, sizeof (w->mtime));
+
+    npending += rec_add (&pending, w, OP_ADD);
+}
+
+void
+checkpoint_rm (struct watch *w)
+{
+    if (file == NULL)
+        return;
+
+    npending += rec_add (&pending, w, OP_RM);
+}
+
+/* Schedules mtime refresh for the watch with events. */
+void
+checkpoint_touch (struct watch *w)
+{
+    if (file == NULL || w->dirty)
+        return;
+
+    if (ndirty == cdirty) {
+        cdirty = cdirty ? cdirty * 2 : 256;
+        dirty = realloc (dirty, cdirty * sizeof (*dirty));
+        assert (dirty != NULL);
+    }
+
+    w->dirty = 1;
+    dirty[ndirty++] = w->wd;
+    if (ndirty == 1)
+        timer_set ();
+}
+
+/* Writes pending records, compacts the file if it grew too much. */
+void
+checkpoint_flush (void)
+{
+    if (fd == -1 || pending.len == 0)
+        return;
+
+    if (write_all (fd, pending.data, pending.len) == -1) {
+        /* a partial record would hide the ones appended after it */
+        WARNING ("checkpoint %s: %s, rewriting", file, strerror (errno));
+        TEMP_FAILURE_RETRY (close (fd));
+        fd = -1;
+        rewrite = 1;
+        timer_set ();
+        return;
+    }
+    nrecs += npending;
+    pending.len = 0;
+    npending = 0;
+
+    if (nrecs > 2 * (unsigned long) watch_count () + SLACK)
+        compact ();
+}
+
+/* Stops checkpointing (on exit or handover). */
+void
+checkpoint_close (void)
+{
+    if (file == NULL)
+        return;
+
+    refresh ();
+    if (rewrite)
+        compact ();
+    else
+        checkpoint_flush ();
+    if (fd != -1)
+        TEMP_FAILURE_RETRY (close (fd));
+    fd = -1;
+    free (file);
+    file = NULL;
+}
@@ -0,0 +1,37 @@
+#ifndef _CHECKPOINT_H
+#define _CHECKPOINT_H
+
+#include "evl.h"
+
+struct watch;
+
+/* single restored watch: descriptor or error code for the path */
+struct checkpoint_res {
+    int  wd;      /* -1 on error */
+    int  err;     /* errno if wd == -1 */
+    int  changed; /* mtime differs from the checkpointed one */
+    char *path;
+};
+
+extern int
+checkpoint_init (struct evl_inst *loop, const char *path);
+
+extern void
+checkpoint_restore (int readd);
+
+extern void
+checkpoint_add (struct watch *w);
+
+extern void
+checkpoint_rm (struct watch *w);
+
+extern void
+checkpoint_touch (struct watch *w);
+
+extern void
+checkpoint_flush (void);
+
+extern void
+checkpoint_close (void);
+
+#endif /* _CHECKPOINT_H */
@@ -4,53 +4,129 @@
 #include <ei.h>
 #include <erl_driver.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include "budget.h"
+#include "chain.h"
+#include "checkpoint.h"
 #include "control.h"
+#include "crawl.h"
+#include "dedup.h"
+#include "encode.h"
 #include "evl.h"
+#include "handover.h"
+#include "history.h"
 #include "log.h"
+#include "out.h"
+#include "poll.h"
 #include "watch.h"
 
-static struct evl_handler *eh = NULL;
+/* connected client: the port owner on stdin/stdout, or a daemon client */
+struct client {
+    struct client      *prev;
+    struct client      *next;
+    struct evl_handler *eh;
+    struct out         *out;
+    int                out_fd;
+    /* input buffer (an incomplete frame is kept at the beginning) */
+    struct {
+        char   *data;
+        size_t len;
+        size_t cap;
+        /* bytes of an oversized frame still to be discarded */
+        size_t skip;
+    } in;
+    /* disconnected, freed by control_flush() */
+    int                gone;
+};
+
+static struct evl_inst *eloop = NULL;
+static struct client *clients = NULL;
+/* client whose command is being handled (gets the replies) */
+static struct client *cur = NULL;
+/* listening socket in daemon mode (NULL if the owner is on stdin/stdout) */
+static struct evl_handler *leh = NULL;
+/* output tunables for new clients (0 - default) */
+static size_t write_max = 0;
+static size_t coalesce = 0;
+static int coalesce_set = 0;
+static long credit0 = -1;
+/* sequence number of the last event */
+static uint64_t seq = 0;
+/* reading of inotify is paused (see control_flush) */
+static int paused = 0;
+/* the instance was handed over, exit when the output is written */
+static int handed_over = 0;
 
 /* control commands */
 enum {
     CMD_ADD_WATCH = 0,
     CMD_RM_WATCH,
+    CMD_ADD_TREE,
+    CMD_STATS,
+    CMD_SET_OPT,
+    CMD_REPLAY,
+    CMD_ACTIVE,
+    CMD_HANDOVER,
     CMD_MAX
 };
 
+/* add_watch options */
+enum {
+    OPT_HASH = 0,
+    OPT_STAT,
+    OPT_PRIORITY,
+    OPT_RATE,
+    OPT_BURST,
+    OPT_SUMMARY_NAMES,
+    OPT_EVICTABLE,
+    OPT_TTL,
+    OPT_POLL,
+    OPT_POLL_INTERVAL,
+    OPT_SNAPSHOT,
+    OPT_MAX
+};
+
 /* control callback prototype */
 typedef void (control_func) (const char *buf, int idx);
 /* array of control callbacks (defined below) */
 static control_func *const funcs[];
 
-/* receive buffer size */
+/* default maximum command size */
 #define RBUF_SZ 2048
-/* receive buffer */
-static char rbuf[RBUF_SZ];
-/* send buffer size */
+static size_t rbuf_sz = 0;
+/* minimum free space in the input buffer for a read */
+#define READ_MIN 4096
+/* maximum number of reads per wakeup (the loop must serve other handlers) */
+#define READS_MAX 16
+/* default send buffer size */
 #define SBUF_SZ 2048
 /* send buffer */
-static char sbuf[SBUF_SZ];
-
-/* Reads exact `count' bytes */
-static ssize_t
-read_exact (int fd, void *buf, size_t count)
-{
-    size_t rem = count;
-
-    while (rem > 0) {
-        ssize_t r = TEMP_FAILURE_RETRY (read (fd, buf, rem));
-        if (r == -1)
-            return -1;
-        rem -= r;
-    }
-
-    return count;
-}
+static char *sbuf = NULL;
+static size_t sbuf_sz = 0;
+/* minimum size of the buffers (an event with the longest name fits) */
+#define BUF_MIN 1024
+#if BUF_MIN < ENCODE_EVENT_MAX
+#error BUF_MIN must fit the largest event
+#endif
+/* maximum message size allowed by {packet, 2} */
+#define PACKET_MAX 65535
+/* event backlog above which inotify is not read while the owner is out of
+ * credits (a socket client that is behind loses its backlog instead) */
+#define PAUSE_BACKLOG (1 << 20)
+/* events sent to all subscribers regardless of their masks */
+#define IN_ALWAYS (IN_IGNORED | IN_Q_OVERFLOW | IN_UNMOUNT)
+/* limits for number of names in a rate limit summary (fits into a packet) */
+#define DEFAULT_SUMMARY_NAMES 16
+#define MAX_SUMMARY_NAMES 128
 
 static void
 encode_tuple (void *buf, int *idx, const char *atom)
@@ -64,19 +140,10 @@ encode_tuple (void *buf, int *idx, const char *atom)
     assert (rc == 0);
 }
 
-static void
+static inline void
 do_write (void *buf, uint16_t count)
 {
-    int fd = fileno (stdout);
-    uint16_t len = htobe16 (count);
-
-    ssize_t sent = TEMP_FAILURE_RETRY (write (fd, &len, sizeof (len)));
-    if (sent == -1)
-        perror ("write");
-    assert (sent == sizeof (len));
-
-    sent = TEMP_FAILURE_RETRY (write (fd, buf, count));
-    assert (sent == count);
+    out_put (cur->out, OUT_CONTROL, buf, count);
 }
 
 static void
@@ -153,99 +220,977 @@ handle_msg (const char *rbuf, uint16_t len)
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 
-static inline void
-flush (int fd, size_t count)
+/* Handles all complete frames in the input buffer of the client. */
+static void
+parse (struct client *c)
 {
-    size_t rem = count;
-    while (rem > 0) {
-        ssize_t n = read_exact (fd, rbuf, MIN (RBUF_SZ, rem));
-        assert (n > 0);
-        rem -= n;
+    size_t off = 0;
+
+    cur = c;
+
+    for (;;) {
+        if (c->in.skip > 0) {
+            size_t n = MIN (c->in.skip, c->in.len - off);
+            off        += n;
+            c->in.skip -= n;
+            if (c->in.skip > 0)
+                break;
+        }
+
+        uint16_t len;
+        if (c->in.len - off < sizeof (len))
+            break;
+        memcpy (&len, c->in.data + off, sizeof (len));
+        len = be16toh (len);
+
+        if (len > rbuf_sz) {
+            /* discard it as it arrives */
+            reply_badarg ();
+            off        += sizeof (len);
+            c->in.skip  = len;
+            continue;
+        }
+
+        if (c->in.len - off < sizeof (len) + len)
+            break;
+
+        handle_msg (c->in.data + off + sizeof (len), len);
+        off += sizeof (len) + len;
     }
+
+    memmove (c->in.data, c->in.data + off, c->in.len - off);
+    c->in.len -= off;
+
+    cur = NULL;
 }
 
-static inline void
-receive (int fd)
+/* The client is gone: the port exits, a daemon client is freed later. */
+static void
+client_close (void *arg, int err)
 {
-    uint16_t len;
-    ssize_t n;
+    struct client *c = arg;
 
-    n = read_exact (fd, &len, sizeof (len));
-    assert (n == sizeof (len));
-    len = be16toh (len);
+    if (leh == NULL) {
+        checkpoint_close ();
+        exit (err ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
 
-    //assert (len <= RBUF_SZ);
-    if (len > RBUF_SZ) {
-        flush (fd, len);
-        reply_badarg ();
+    DEBUG ("%s: client %d: %s", __func__, c->eh->fd, err ? strerror (err) : "closed");
+    c->gone = 1;
+}
+
+/* Reads what is available and handles complete commands, never blocks. */
+static void
+receive (struct client *c)
+{
+    for (int i = 0; i < READS_MAX; i++) {
+        if (c->in.cap - c->in.len < READ_MIN) {
+            c->in.cap  = c->in.cap ? c->in.cap * 2 : 2 * READ_MIN;
+            c->in.data = realloc (c->in.data, c->in.cap);
+            assert (c->in.data != NULL);
+        }
+
+        ssize_t n = TEMP_FAILURE_RETRY (read (c->eh->fd, c->in.data + c->in.len,
+                                              c->in.cap - c->in.len));
+        if (n == -1) {
+            if (errno == EAGAIN)
+                break;
+            ERR ("read: %s", strerror (errno));
+            client_close (c, errno);
+            return;
+        }
+        if (n == 0) { /* the owner closed the port */
+            client_close (c, 0);
+            return;
+        }
+
+        c->in.len += n;
+        parse (c);
+    }
+}
+
+static void
+control_handler (struct evl_handler *eh, uint32_t events, void *arg)
+{
+    struct client *c = arg;
+
+    if (c->gone)
         return;
+
+    if (events & EPOLLIN) {
+        /* exits (or drops the client) on end of file */
+        receive (c);
+    } else if (events & (EPOLLERR | EPOLLHUP)) {
+        client_close (c, 0);
     }
+}
+
+/* Encodes message sent when the owner runs out of credits. */
+static void
+encode_passive (char *buf, int *idx)
+{
+    int rc;
+
+    rc = ei_encode_version (buf, idx);
+    assert (rc == 0);
+    rc = ei_encode_atom (buf, idx, "einotify_passive");
+    assert (rc == 0);
+}
+
+/* Queues the passive message (nothing was granted). */
+static void
+put_passive (struct client *c)
+{
+    char buf[32];
+    int idx = 0;
+
+    encode_passive (buf, &idx);
+    out_put (c->out, OUT_CONTROL, buf, idx);
+}
+
+static void
+buf_resize (char **buf, size_t *sz, size_t new_sz)
+{
+    char *p = realloc (*buf, new_sz);
+    assert (p != NULL);
+    *buf = p;
+    *sz  = new_sz;
+}
+
+static void
+client_new (int in_fd, int out_fd)
+{
+    struct client *c = calloc (1, sizeof (*c));
+    assert (c != NULL);
+
+    int fl = fcntl (in_fd, F_GETFL);
+    if (fl == -1 || fcntl (in_fd, F_SETFL, fl | O_NONBLOCK) == -1)
+        WARNING ("fcntl (O_NONBLOCK): %s", strerror (errno));
+
+    c->eh = evl_add (eloop, in_fd, EPOLLIN, &control_handler, c);
+    assert (c->eh != NULL);
+    c->out_fd = out_fd;
+    c->out = out_new (eloop, out_fd, &client_close, c);
+
+    char buf[32];
+    int idx = 0;
+    encode_passive (buf, &idx);
+    out_set_passive (c->out, buf, idx);
+    out_set_credit (c->out, credit0);
+    if (credit0 == 0)
+        put_passive (c);
+    if (write_max)
+        out_set_write_max (c->out, write_max);
+    if (coalesce_set)
+        out_set_coalesce (c->out, coalesce);
+
+    chain_add (clients, c);
+}
+
+static void
+client_free (struct client *c)
+{
+    chain_del (clients, c);
+
+    watch_drop_client (c);
+    poll_drop_client (c);
+    crawl_drop_client (c);
+
+    evl_del (eloop, c->eh);
+    TEMP_FAILURE_RETRY (close (c->eh->fd));
+    out_free (c->out);
+    TEMP_FAILURE_RETRY (close (c->out_fd));
+    free (c->in.data);
+    free (c);
+}
+
+/* Accepts daemon clients; the socket is used for both directions, the
+ * output gets its own descriptor to be registered in the loop separately. */
+static void
+accept_handler (struct evl_handler *eh, uint32_t _events, void *_nil)
+{
+    for (;;) {
+        int fd = accept4 (eh->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno != EAGAIN && errno != EINTR)
+                WARNING ("accept: %s", strerror (errno));
+            return;
+        }
+
+        int out_fd = fcntl (fd, F_DUPFD_CLOEXEC, 0);
+        if (out_fd == -1) {
+            WARNING ("fcntl (F_DUPFD): %s", strerror (errno));
+            TEMP_FAILURE_RETRY (close (fd));
+            return;
+        }
+
+        DEBUG ("%s: client %d connected", __func__, fd);
+        client_new (fd, out_fd);
+    }
+}
+
+/**
+ * Starts serving the owner on stdin/stdout, or with @a lfd != -1 clients
+ * connecting to the listening socket @a lfd (daemon mode).
+ */
+void
+control_init (struct evl_inst *loop, int lfd)
+{
+    assert (eloop == NULL);
+
+    eloop = loop;
+    rbuf_sz = RBUF_SZ;
+    buf_resize (&sbuf, &sbuf_sz, SBUF_SZ);
+    encode_init ();
+    history_init ();
+
+    if (lfd == -1) {
+        client_new (fileno (stdin), fileno (stdout));
+    } else {
+        leh = evl_add (loop, lfd, EPOLLIN, &accept_handler, NULL);
+        assert (leh != NULL);
+    }
+}
+
+/**
+ * Changes a runtime tunable (see CONTROL_OPT_*).
+ *
+ * @return 0 on success, -1 if the option or value is invalid
+ */
+int
+control_set_opt (struct evl_inst *loop, int opt, unsigned long val)
+{
+    struct client *c;
+
+    assert (eloop != NULL);
+
+    /* socket clients tune their own output only, the rest is set on the
+     * command line of the daemon */
+    if (leh != NULL && cur != NULL) {
+        switch (opt) {
+        case CONTROL_OPT_WRITE_MAX:
+            if (val == 0)
+                return -1;
+            out_set_write_max (cur->out, val);
+            return 0;
+        case CONTROL_OPT_COALESCE:
+            out_set_coalesce (cur->out, val);
+            return 0;
+        default:
+            return -1;
+        }
+    }
+
+    switch (opt) {
+    case CONTROL_OPT_BATCH:
+        if (val == 0 || val > 65536)
+            return -1;
+        return evl_set_max_events (loop, val);
+    case CONTROL_OPT_RBUF:
+        if (val < BUF_MIN || val > PACKET_MAX)
+            return -1;
+        rbuf_sz = val;
+        return 0;
+    case CONTROL_OPT_SBUF:
+        if (val < BUF_MIN || val > PACKET_MAX)
+            return -1;
+        buf_resize (&sbuf, &sbuf_sz, val);
+        return 0;
+    case CONTROL_OPT_WRITE_MAX:
+        if (val == 0)
+            return -1;
+        write_max = val;
+        chain_for_each (clients, c)
+            out_set_write_max (c->out, val);
+        return 0;
+    case CONTROL_OPT_COALESCE:
+        coalesce = val;
+        coalesce_set = 1;
+        chain_for_each (clients, c)
+            out_set_coalesce (c->out, val);
+        return 0;
+    case CONTROL_OPT_LOG_LEVEL:
+        return log_set_level (val);
+    case CONTROL_OPT_WATCH_BUDGET:
+        budget_set_limit (val);
+        return 0;
+    case CONTROL_OPT_HISTORY:
+        return history_set_size (val);
+    case CONTROL_OPT_ACTIVE:
+        /* initial credits on the command line, later changes are granted
+         * with the active command */
+        if (val > LONG_MAX || cur != NULL)
+            return -1;
+        credit0 = val;
+        chain_for_each (clients, c) {
+            out_set_credit (c->out, val);
+            if (val == 0)
+                put_passive (c);
+        }
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+/* Drops the event backlog of a socket client that does not keep up, so the
+ * shared inotify instance is not paused for it.  The client gets
+ * IN_Q_OVERFLOW and may catch up with replay. */
+static void
+overflow (struct client *c)
+{
+    WARNING ("%s: client on fd %d is behind, dropping %zu bytes of events",
+             __func__, c->out_fd, out_backlog (c->out));
+    out_drop (c->out);
 
-    n = read_exact (fd, rbuf, len);
+    /* concerns this client only: not recorded, so no sequence number */
+    int n = encode_event (sbuf, sbuf_sz, -1, IN_Q_OVERFLOW, 0, NULL, 0, NULL, 0);
     assert (n > 0);
+    out_put (c->out, OUT_HIGH, sbuf, n);
+}
+
+/* Writes out replies and events collected during the loop iteration and
+ * frees disconnected clients.  While the owner has no credits and its
+ * backlog is large, events are left in the kernel queue; socket clients
+ * lose their backlog instead (see overflow()). */
+void
+control_flush (struct evl_inst *loop)
+{
+    struct client *c, *next;
+    int pause = 0;
+
+    if (handed_over) {
+        c = clients;
+        out_flush (c->out);
+        if (out_idle (c->out))
+            exit (EXIT_SUCCESS);
+        return;
+    }
+
+    checkpoint_flush ();
+
+    chain_for_each_safe (clients, c, next) {
+        if (!c->gone)
+            out_flush (c->out);
+        if (c->gone) {
+            if (!out_busy (c->out))
+                client_free (c);
+            continue;
+        }
+
+        if (leh != NULL) {
+            if (out_backlog (c->out) > PAUSE_BACKLOG)
+                overflow (c);
+            continue;
+        }
+
+        pause |= out_credit (c->out) == 0
+            && out_backlog (c->out) > (paused ? PAUSE_BACKLOG / 2 : PAUSE_BACKLOG);
+    }
+
+    /* nothing is read while the state is sent to a new port */
+    if (handover_busy ())
+        pause = 1;
+
+    if (pause != paused) {
+        watch_pause (pause);
+        paused = pause;
+    }
+}
+
+/* Returns the owner on stdin/stdout (NULL in daemon mode). */
+struct client *
+control_owner (void)
+{
+    return leh == NULL ? clients : NULL;
+}
+
+/* Checks if everything queued for the owner has been written out. */
+int
+control_owner_idle (void)
+{
+    struct client *c = control_owner ();
 
-    handle_msg (rbuf, len);
+    return c == NULL || out_idle (c->out);
 }
 
+/* Gets state carried over to a new port on handover. */
+void
+control_get_state (uint64_t *last_seq, long *credit)
+{
+    *last_seq = seq;
+    *credit   = out_credit (control_owner ()->out);
+}
+
+void
+control_set_state (uint64_t last_seq, long credit)
+{
+    seq = last_seq;
+    out_set_credit (control_owner ()->out, credit);
+}
+
+/**
+ * Stops handling commands after the handover.  Events already read are
+ * written regardless of credits (they would be lost otherwise), then the
+ * port exits.
+ */
+void
+control_shutdown (void)
+{
+    struct client *c = control_owner ();
+
+    evl_mod (eloop, c->eh, 0);
+    out_set_credit (c->out, -1);
+    checkpoint_close ();
+    handed_over = 1;
+}
+
+/* Checks if the client subscribed to the event of the watch `w' (NULL for
+ * poll mode and unknown watches). */
+static int
+wants (const struct client *c, const struct watch *w, int wd, uint32_t mask)
+{
+    if (c->gone)
+        return 0;
+
+    if (w != NULL) {
+        const struct sub *s = watch_sub (w, c);
+        return s != NULL && (mask & (s->mask | IN_ALWAYS));
+    }
+
+    if (wd < -1)
+        return poll_client (wd) == c;
+
+    /* queue overflow concerns everyone */
+    return wd == -1 || leh == NULL;
+}
+
+/* Returns buffer for messages that do not fit into `sbuf'. */
+static char *
+large_buf (void)
+{
+    static char *lbuf = NULL;
+
+    if (lbuf == NULL) {
+        lbuf = malloc (PACKET_MAX);
+        assert (lbuf != NULL);
+    }
+
+    return lbuf;
+}
+
+/* Output class of the message for the client (`prio' if not subscribed). */
+static inline int
+sub_class (const struct sub *s, int prio)
+{
+    return s != NULL ? OUT_HIGH + s->prio : prio;
+}
+
+/* Queues the message for the clients subscribed to the watch. */
 static void
-control_handler (struct evl_handler *eh, uint32_t events, void *_nil)
+route (int prio, int wd, uint32_t mask, const void *buf, uint16_t count)
 {
-    if (events & EPOLLIN) {
-        receive (eh->fd);
+    struct watch *w = watch_get (wd);
+    struct client *c;
+
+    chain_for_each (clients, c) {
+        if (wants (c, w, wd, mask))
+            out_put (c->out, sub_class (w ? watch_sub (w, c) : NULL, prio), buf, count);
+    }
+}
+
+/**
+ * Sends the event to the subscribers of the watch except those marked to
+ * skip it (see watch.c).  Only the subscribers that asked for it get @a stx
+ * attached, the history keeps the event with it.
+ */
+void
+control_notify (int prio, int wd, uint32_t mask, uint32_t cookie, const char *name,
+                uint32_t len, const struct statx *stx)
+{
+    struct watch *w = watch_get (wd);
+    struct client *c;
+    char *xbuf = NULL;
+    int xn = 0;
+
+    assert (eloop != NULL);
+
+    int n = encode_event (sbuf, sbuf_sz, wd, mask, cookie, name, len, NULL, ++seq);
+    assert (n > 0);
+    if (stx != NULL) {
+        xbuf = large_buf ();
+        xn = encode_event (xbuf, PACKET_MAX, wd, mask, cookie, name, len, stx, seq);
+        assert (xn > 0);
     }
 
-    if (events & (EPOLLERR | EPOLLHUP)) {
-        exit (EXIT_SUCCESS);
+    history_add (seq, wd, mask, xbuf ? xbuf : sbuf, xbuf ? xn : n);
+
+    /* repeated events differ only in the sequence number */
+    int sl = encode_seq_len (seq);
+
+    chain_for_each (clients, c) {
+        const struct sub *s = w ? watch_sub (w, c) : NULL;
+
+        if (!wants (c, w, wd, mask) || (s != NULL && s->skip))
+            continue;
+
+        if (xbuf != NULL && s != NULL && (s->flags & WATCH_F_STAT))
+            out_put_key (c->out, sub_class (s, prio), xbuf, xn, xn - sl);
+        else
+            out_put_key (c->out, sub_class (s, prio), sbuf, n, n - sl);
     }
 }
 
+/* Sends IN_IGNORED to the client unsubscribed from a watch still used by
+ * others. */
 void
-control_init (struct evl_inst *loop)
+control_ignored (struct client *c, int wd, int prio)
+{
+    /* not recorded (a replay would send it to the other subscribers) */
+    int n = encode_event (sbuf, sbuf_sz, wd, IN_IGNORED, 0, NULL, 0, NULL, 0);
+    assert (n > 0);
+
+    if (!c->gone)
+        out_put (c->out, prio, sbuf, n);
+}
+
+static void
+crawl_header (char *buf, int *idx, unsigned int id, int n)
 {
-    assert (eh == NULL);
-    eh = evl_add (loop, fileno (stdin), EPOLLIN, &control_handler, NULL);
-    assert (eh != NULL);
+    int rc;
+
+    rc = ei_encode_version (buf, idx);
+    assert (rc == 0);
+    rc = ei_encode_tuple_header (buf, idx, 3);
+    assert (rc == 0);
+    rc = ei_encode_atom (buf, idx, "einotify_crawl");
+    assert (rc == 0);
+    rc = ei_encode_ulong (buf, idx, id);
+    assert (rc == 0);
+    rc = ei_encode_list_header (buf, idx, n);
+    assert (rc == 0);
 }
 
+static void
+crawl_entry (char *buf, int *idx, const struct crawl_res *r)
+{
+    int rc;
+
+    if (r->wd == -1) {
+        rc = ei_encode_tuple_header (buf, idx, 3);
+        assert (rc == 0);
+        rc = ei_encode_atom (buf, idx, "error");
+        assert (rc == 0);
+        rc = ei_encode_long (buf, idx, r->err);
+        assert (rc == 0);
+    } else {
+        rc = ei_encode_tuple_header (buf, idx, 2);
+        assert (rc == 0);
+        rc = ei_encode_long (buf, idx, r->wd);
+        assert (rc == 0);
+    }
+    rc = ei_encode_string (buf, idx, r->path);
+    assert (rc == 0);
+}
+
+/* Sends crawl results as one or more messages fitting into a packet. */
 void
-control_notify (int wd, uint32_t mask, uint32_t cookie, const char *name, uint32_t len)
+control_crawl (struct client *c, unsigned int id, const struct crawl_res *res, int n)
 {
-    assert (eh != NULL);
+    char *cbuf = large_buf ();
+
+    int hdr = 0, nil = 0;
+    crawl_header (NULL, &hdr, id, n);
+    ei_encode_empty_list (NULL, &nil);
+
+    int i = 0;
+    while (i < n) {
+        /* count entries fitting into a single packet */
+        int sz = hdr + nil, cnt = 0;
+        while (i + cnt < n) {
+            int esz = 0;
+            crawl_entry (NULL, &esz, &res[i + cnt]);
+            if (sz + esz > PACKET_MAX)
+                break;
+            sz += esz;
+            cnt++;
+        }
+        assert (cnt > 0);
+
+        int idx = 0;
+        crawl_header (cbuf, &idx, id, cnt);
+        for (int j = 0; j < cnt; j++)
+            crawl_entry (cbuf, &idx, &res[i + j]);
+        ei_encode_empty_list (cbuf, &idx);
 
+        out_put (c->out, OUT_CONTROL, cbuf, idx);
+        i += cnt;
+    }
+}
+
+void
+control_crawl_done (struct client *c, unsigned int id, unsigned long watched,
+                    unsigned long failed)
+{
     int rc, idx = 0;
 
     rc = ei_encode_version (sbuf, &idx);
     assert (rc == 0);
-    rc = ei_encode_tuple_header (sbuf, &idx, 5);
+    rc = ei_encode_tuple_header (sbuf, &idx, 4);
+    assert (rc == 0);
+    rc = ei_encode_atom (sbuf, &idx, "einotify_crawl_done");
+    assert (rc == 0);
+    rc = ei_encode_ulong (sbuf, &idx, id);
+    assert (rc == 0);
+    rc = ei_encode_ulong (sbuf, &idx, watched);
+    assert (rc == 0);
+    rc = ei_encode_ulong (sbuf, &idx, failed);
+    assert (rc == 0);
+
+    out_put (c->out, OUT_CONTROL, sbuf, idx);
+}
+
+static void
+restored_header (char *buf, int *idx, int n)
+{
+    int rc;
+
+    rc = ei_encode_version (buf, idx);
+    assert (rc == 0);
+    rc = ei_encode_tuple_header (buf, idx, 3);
+    assert (rc == 0);
+    rc = ei_encode_atom (buf, idx, "einotify_restored");
     assert (rc == 0);
+    rc = ei_encode_list_header (buf, idx, n);
+    assert (rc == 0);
+}
 
-    rc = ei_encode_atom (sbuf, &idx, "einotify");
+static void
+restored_entry (char *buf, int *idx, const struct checkpoint_res *r)
+{
+    int rc;
+
+    rc = ei_encode_tuple_header (buf, idx, 3);
     assert (rc == 0);
-    rc = ei_encode_ulong (sbuf, &idx, wd);
+    if (r->wd == -1) {
+        rc = ei_encode_atom (buf, idx, "error");
+        assert (rc == 0);
+        rc = ei_encode_long (buf, idx, r->err);
+        assert (rc == 0);
+        rc = ei_encode_string (buf, idx, r->path);
+        assert (rc == 0);
+    } else {
+        rc = ei_encode_long (buf, idx, r->wd);
+        assert (rc == 0);
+        rc = ei_encode_string (buf, idx, r->path);
+        assert (rc == 0);
+        rc = ei_encode_atom (buf, idx, r->changed ? "true" : "false");
+        assert (rc == 0);
+    }
+}
+
+/* Sends watches restored from the checkpoint to the owner as one or more
+ * messages fitting into a packet, the last one flagged. */
+void
+control_restored (const struct checkpoint_res *res, int n)
+{
+    struct client *c = control_owner ();
+    char *buf = large_buf ();
+
+    int hdr = 0, tail = 0;
+    restored_header (NULL, &hdr, n);
+    ei_encode_empty_list (NULL, &tail);
+    ei_encode_atom (NULL, &tail, "false");
+
+    int i = 0;
+    do {
+        /* count entries fitting into a single packet */
+        int sz = hdr + tail, cnt = 0;
+        while (i + cnt < n) {
+            int esz = 0;
+            restored_entry (NULL, &esz, &res[i + cnt]);
+            if (sz + esz > PACKET_MAX)
+                break;
+            sz += esz;
+            cnt++;
+        }
+
+        int rc, idx = 0;
+        restored_header (buf, &idx, cnt);
+        for (int j = 0; j < cnt; j++)
+            restored_entry (buf, &idx, &res[i + j]);
+        if (cnt > 0) {
+            rc = ei_encode_empty_list (buf, &idx);
+            assert (rc == 0);
+        }
+        i += cnt;
+        rc = ei_encode_atom (buf, &idx, i == n ? "true" : "false");
+        assert (rc == 0);
+
+        out_put (c->out, OUT_CONTROL, buf, idx);
+    } while (i < n);
+}
+
+static void
+encode_summary (char *buf, int *idx, int wd, const unsigned long counts[32],
+                const char *const *names, unsigned int nnames, int truncated)
+{
+    int rc, n = 0;
+
+    for (int i = 0; i < 32; i++) {
+        if (counts[i])
+            n++;
+    }
+
+    rc = ei_encode_version (buf, idx);
     assert (rc == 0);
-    rc = ei_encode_ulong (sbuf, &idx, mask);
+    rc = ei_encode_tuple_header (buf, idx, 5);
     assert (rc == 0);
-    rc = ei_encode_ulong (sbuf, &idx, cookie);
+    rc = ei_encode_atom (buf, idx, "einotify_summary");
     assert (rc == 0);
-    if (len)
-        rc = ei_encode_string (sbuf, &idx, name);
-    else
-        rc = ei_encode_empty_list (sbuf, &idx);
+    rc = ei_encode_long (buf, idx, wd);
     assert (rc == 0);
 
-    do_write (sbuf, idx);
+    rc = ei_encode_list_header (buf, idx, n);
+    assert (rc == 0);
+    for (int i = 0; i < 32; i++) {
+        if (counts[i] == 0)
+            continue;
+        rc = ei_encode_tuple_header (buf, idx, 2);
+        assert (rc == 0);
+        rc = ei_encode_ulong (buf, idx, 1UL << i);
+        assert (rc == 0);
+        rc = ei_encode_ulong (buf, idx, counts[i]);
+        assert (rc == 0);
+    }
+    if (n > 0) {
+        rc = ei_encode_empty_list (buf, idx);
+        assert (rc == 0);
+    }
+
+    rc = ei_encode_list_header (buf, idx, nnames);
+    assert (rc == 0);
+    for (unsigned int i = 0; i < nnames; i++) {
+        rc = ei_encode_string (buf, idx, names[i]);
+        assert (rc == 0);
+    }
+    if (nnames > 0) {
+        rc = ei_encode_empty_list (buf, idx);
+        assert (rc == 0);
+    }
+
+    rc = ei_encode_atom (buf, idx, truncated ? "true" : "false");
+    assert (rc == 0);
+}
+
+/* Sends #einotify_summary{} for a rate limited subscription of the client. */
+void
+control_summary (struct client *c, int prio, int wd, const unsigned long counts[32],
+                 const char *const *names, unsigned int nnames, int truncated)
+{
+    char *buf = large_buf ();
+    int idx = 0;
+
+    encode_summary (NULL, &idx, wd, counts, names, nnames, truncated);
+    assert (idx <= PACKET_MAX);
+
+    idx = 0;
+    encode_summary (buf, &idx, wd, counts, names, nnames, truncated);
+
+    if (!c->gone)
+        out_put (c->out, prio, buf, idx);
+}
+
+static void
+snapshot_header (char *buf, int *idx, int wd, int n)
+{
+    int rc;
+
+    rc = ei_encode_version (buf, idx);
+    assert (rc == 0);
+    rc = ei_encode_tuple_header (buf, idx, 4);
+    assert (rc == 0);
+    rc = ei_encode_atom (buf, idx, "einotify_snapshot");
+    assert (rc == 0);
+    rc = ei_encode_long (buf, idx, wd);
+    assert (rc == 0);
+    rc = ei_encode_list_header (buf, idx, n);
+    assert (rc == 0);
+}
+
+static void
+snapshot_entry (char *buf, int *idx, const struct snapshot_ent *e)
+{
+    int rc;
+
+    rc = ei_encode_tuple_header (buf, idx, 2);
+    assert (rc == 0);
+    rc = ei_encode_ulong (buf, idx, e->mask);
+    assert (rc == 0);
+    rc = ei_encode_string (buf, idx, e->name);
+    assert (rc == 0);
+}
+
+/**
+ * Sends directory entries of the watch @a wd as one or more messages fitting
+ * into a packet.  They are queued ahead of live events and take credits.
+ */
+void
+control_snapshot (int wd, const struct snapshot_ent *ents, int n, int last)
+{
+    char *buf = large_buf ();
+
+    int hdr = 0, tail = 0;
+    snapshot_header (NULL, &hdr, wd, n);
+    ei_encode_empty_list (NULL, &tail);
+    ei_encode_atom (NULL, &tail, "false");
+
+    int i = 0;
+    do {
+        /* count entries fitting into a single packet */
+        int sz = hdr + tail, cnt = 0;
+        while (i + cnt < n) {
+            int esz = 0;
+            snapshot_entry (NULL, &esz, &ents[i + cnt]);
+            if (sz + esz > PACKET_MAX)
+                break;
+            sz += esz;
+            cnt++;
+        }
+
+        int rc, idx = 0;
+        snapshot_header (buf, &idx, wd, cnt);
+        for (int j = 0; j < cnt; j++)
+            snapshot_entry (buf, &idx, &ents[i + j]);
+        if (cnt > 0) {
+            rc = ei_encode_empty_list (buf, &idx);
+            assert (rc == 0);
+        }
+        i += cnt;
+        rc = ei_encode_atom (buf, &idx, last && i == n ? "true" : "false");
+        assert (rc == 0);
+
+        out_put (cur->out, OUT_REPLAY, buf, idx);
+    } while (i < n);
+}
+
+/* Sends #einotify_evicted{} for a watch removed by the budget manager. */
+void
+control_evicted (int wd, const char *path, const char *reason)
+{
+    char *buf = large_buf ();
+    int rc, idx = 0;
+
+    rc = ei_encode_version (buf, &idx);
+    assert (rc == 0);
+    rc = ei_encode_tuple_header (buf, &idx, 4);
+    assert (rc == 0);
+    rc = ei_encode_atom (buf, &idx, "einotify_evicted");
+    assert (rc == 0);
+    rc = ei_encode_long (buf, &idx, wd);
+    assert (rc == 0);
+    rc = ei_encode_string (buf, &idx, path);
+    assert (rc == 0);
+    rc = ei_encode_atom (buf, &idx, reason);
+    assert (rc == 0);
+
+    route (OUT_NORMAL, wd, ~0U, buf, idx);
 }
 
 /******************************************************************************/
 
+/* Decodes list of {Key, Value} option pairs. */
+static int
+decode_opts (const char *buf, int *idx, struct watch_opts *opts)
+{
+    int n, ar;
+
+    if (ei_decode_list_header (buf, idx, &n))
+        return -1;
+
+    for (int i = 0; i < n; i++) {
+        unsigned long key, val;
+
+        if (ei_decode_tuple_header (buf, idx, &ar)
+            || ar != 2
+            || ei_decode_ulong (buf, idx, &key)
+            || ei_decode_ulong (buf, idx, &val))
+            return -1;
+
+        switch (key) {
+        case OPT_HASH:
+            if (val)
+                opts->flags |= WATCH_F_HASH;
+            else
+                opts->flags &= ~WATCH_F_HASH;
+            break;
+        case OPT_STAT:
+            if (val)
+                opts->flags |= WATCH_F_STAT;
+            else
+                opts->flags &= ~WATCH_F_STAT;
+            break;
+        case OPT_PRIORITY:
+            if (val >= WATCH_NPRIO)
+                return -1;
+            opts->prio = val;
+            break;
+        case OPT_RATE:
+            opts->rate = val;
+            break;
+        case OPT_BURST:
+            opts->burst = val;
+            break;
+        case OPT_SUMMARY_NAMES:
+            if (val > MAX_SUMMARY_NAMES)
+                return -1;
+            opts->names = val;
+            break;
+        case OPT_EVICTABLE:
+            opts->evictable = !!val;
+            break;
+        case OPT_TTL:
+            opts->ttl = val;
+            break;
+        case OPT_POLL:
+            if (val)
+                opts->flags |= WATCH_F_POLL;
+            else
+                opts->flags &= ~WATCH_F_POLL;
+            break;
+        case OPT_POLL_INTERVAL:
+            if (val == 0 || val > UINT_MAX)
+                return -1;
+            opts->poll_ms = val;
+            break;
+        case OPT_SNAPSHOT:
+            opts->snapshot = !!val;
+            break;
+        default:
+            return -1;
+        }
+    }
+
+    /* proper list tail */
+    if (n > 0 && ei_decode_list_header (buf, idx, &n))
+        return -1;
+
+    return 0;
+}
+
 static void
 add_watch (const char *buf, int idx)
 {
     int ar, tp, sz;
     unsigned long mask;
+    struct watch_opts opts = {
+        .flags = 0,
+        .prio  = WATCH_PRIO_NORMAL,
+        .names = DEFAULT_SUMMARY_NAMES,
+    };
 
     if (ei_decode_tuple_header (buf, &idx, &ar)
-        || ar != 2
+        || (ar != 2 && ar != 3)
         || ei_get_type (buf, &idx, &tp, &sz)) { // FIXME: check tp
         reply_badarg ();
         return;
@@ -255,17 +1200,20 @@ add_watch (const char *buf, int idx)
     assert (f != NULL);
 
     if (ei_decode_string (buf, &idx, f)
-        || ei_decode_ulong (buf, &idx, &mask)) {
+        || ei_decode_ulong (buf, &idx, &mask)
+        || (ar == 3 && decode_opts (buf, &idx, &opts))) {
         free (f);
         reply_badarg ();
         return;
     }
 
-    int wfd = watch_add (f, mask);
+    int wfd = watch_add (f, mask, &opts, cur);
     if (wfd == -1) {
         reply_error (errno);
     } else {
         reply_add (wfd);
+        if (opts.snapshot)
+            snapshot_send (wfd, f);
     }
 
     free (f);
@@ -274,19 +1222,253 @@ add_watch (const char *buf, int idx)
 static void
 rm_watch (const char *buf, int idx)
 {
-    unsigned long wfd;
+    long wfd;
 
-    if (ei_decode_ulong (buf, &idx, &wfd)) {
+    if (ei_decode_long (buf, &idx, &wfd)) {
         reply_badarg ();
         return;
     }
 
-    int rc = watch_rm (wfd);
-    if (rc == 0) {
-        reply_ok ();
+    struct watch *w = watch_get (wfd);
+    int prio = sub_class (w ? watch_sub (w, cur) : NULL, OUT_NORMAL);
+
+    int rc = watch_rm (wfd, cur);
+    if (rc != 0) {
+        reply_error (errno);
+        return;
+    }
+
+    reply_ok ();
+
+    /* still used by other clients: IN_IGNORED for this one only */
+    w = watch_get (wfd);
+    if (w != NULL && !w->dead)
+        control_ignored (cur, wfd, prio);
+}
+
+static void
+add_tree (const char *buf, int idx)
+{
+    int ar, tp, sz;
+    unsigned long mask;
+
+    if (ei_decode_tuple_header (buf, &idx, &ar)
+        || ar != 2
+        || ei_get_type (buf, &idx, &tp, &sz)) {
+        reply_badarg ();
+        return;
+    }
+
+    char *f = malloc (sz + 1);
+    assert (f != NULL);
+
+    if (ei_decode_string (buf, &idx, f)
+        || ei_decode_ulong (buf, &idx, &mask)) {
+        free (f);
+        reply_badarg ();
+        return;
+    }
+
+    /* watches of a crawl would miss the table sent on handover */
+    if (handover_pending ()) {
+        free (f);
+        reply_error (EBUSY);
+        return;
+    }
+
+    int id = crawl_start (watch_fd (), f, mask, 0, cur);
+    if (id == -1) {
+        reply_error (errno);
+    } else {
+        reply_add (id);
+    }
+
+    free (f);
+}
+
+static void
+encode_counter (char *buf, int *idx, const char *key, uint64_t val)
+{
+    int rc;
+
+    rc = ei_encode_tuple_header (buf, idx, 2);
+    assert (rc == 0);
+    rc = ei_encode_atom (buf, idx, key);
+    assert (rc == 0);
+    rc = ei_encode_ulonglong (buf, idx, val);
+    assert (rc == 0);
+}
+
+static void
+stats (const char *buf, int idx)
+{
+    int rc;
+    struct dedup_stats ds;
+    struct budget_stats bs;
+    struct poll_stats ps;
+
+    dedup_get_stats (&ds);
+    budget_get_stats (&bs);
+    poll_get_stats (&ps);
+
+    idx = 0;
+    encode_tuple (sbuf, &idx, "ok");
+    rc = ei_encode_list_header (sbuf, &idx, 19);
+    assert (rc == 0);
+    encode_counter (sbuf, &idx, "hashed", ds.hashed);
+    encode_counter (sbuf, &idx, "hash_ns", ds.hash_ns);
+    encode_counter (sbuf, &idx, "suppressed", ds.suppressed);
+    encode_counter (sbuf, &idx, "coalesced", out_coalesced (cur->out));
+    encode_counter (sbuf, &idx, "queued_high", out_queued (cur->out, OUT_HIGH));
+    encode_counter (sbuf, &idx, "queued_normal", out_queued (cur->out, OUT_NORMAL));
+    encode_counter (sbuf, &idx, "queued_low", out_queued (cur->out, OUT_LOW));
+    encode_counter (sbuf, &idx, "watch_budget", bs.limit);
+    encode_counter (sbuf, &idx, "watches", bs.watches);
+    encode_counter (sbuf, &idx, "evictable", bs.evictable);
+    encode_counter (sbuf, &idx, "evicted", bs.evicted);
+    encode_counter (sbuf, &idx, "poll_watches", ps.watches);
+    encode_counter (sbuf, &idx, "poll_scans", ps.scans);
+    encode_counter (sbuf, &idx, "poll_stats", ps.stats);
+    encode_counter (sbuf, &idx, "seq", seq);
+    encode_counter (sbuf, &idx, "history_oldest", history_oldest ());
+    encode_counter (sbuf, &idx, "history_events", history_count ());
+    encode_counter (sbuf, &idx, "paused", paused);
+    encode_counter (sbuf, &idx, "overflowed", out_dropped (cur->out));
+    rc = ei_encode_empty_list (sbuf, &idx);
+    assert (rc == 0);
+
+    do_write (sbuf, idx);
+}
+
+static void
+set_opt (const char *buf, int idx)
+{
+    int ar;
+    unsigned long opt, val;
+
+    if (ei_decode_tuple_header (buf, &idx, &ar)
+        || ar != 2
+        || ei_decode_ulong (buf, &idx, &opt)
+        || ei_decode_ulong (buf, &idx, &val)
+        || control_set_opt (eloop, opt, val)) {
+        reply_badarg ();
+        return;
+    }
+
+    reply_ok ();
+}
+
+static void
+replay_event (int wd, uint32_t mask, const void *data, size_t len, void *arg)
+{
+    struct client *c = arg;
+
+    if (wants (c, watch_get (wd), wd, mask))
+        out_put (c->out, OUT_REPLAY, data, len);
+}
+
+static void
+replay (const char *buf, int idx)
+{
+    int rc;
+    unsigned long long after;
+
+    if (ei_decode_ulonglong (buf, &idx, &after)) {
+        reply_badarg ();
+        return;
+    }
+
+    /* events after `after' are no longer (or never were) recorded */
+    uint64_t oldest = history_count () ? history_oldest () : seq + 1;
+    if (after < seq && after + 1 < oldest) {
+        idx = 0;
+        encode_tuple (sbuf, &idx, "error");
+        rc = ei_encode_tuple_header (sbuf, &idx, 2);
+        assert (rc == 0);
+        rc = ei_encode_atom (sbuf, &idx, "out_of_window");
+        assert (rc == 0);
+        rc = ei_encode_ulonglong (sbuf, &idx, oldest);
+        assert (rc == 0);
+        do_write (sbuf, idx);
+        return;
+    }
+
+    /* {ok, Last} followed by the recorded events (queued ahead of live
+     * events, they take credits like them) */
+    idx = 0;
+    encode_tuple (sbuf, &idx, "ok");
+    rc = ei_encode_ulonglong (sbuf, &idx, seq);
+    assert (rc == 0);
+    do_write (sbuf, idx);
+
+    history_replay (after, &replay_event, cur);
+}
+
+/* {active, true | N}: unlimited events or N more (inet style) */
+static void
+active (const char *buf, int idx)
+{
+    unsigned long n;
+    char atom[MAXATOMLEN_UTF8];
+
+    if (ei_decode_atom (buf, &idx, atom) == 0) {
+        if (strcmp (atom, "true") != 0) {
+            reply_badarg ();
+            return;
+        }
+        out_set_credit (cur->out, -1);
+    } else if (ei_decode_ulong (buf, &idx, &n) == 0 && n <= LONG_MAX / 2) {
+        long credit = out_credit (cur->out);
+        out_set_credit (cur->out, credit < 0 ? (long) n : credit + (long) n);
     } else {
+        reply_badarg ();
+        return;
+    }
+
+    reply_ok ();
+
+    /* nothing granted */
+    if (out_credit (cur->out) == 0)
+        put_passive (cur);
+}
+
+/* Hands the inotify instance over to a new port connecting to the path. */
+static void
+handover (const char *buf, int idx)
+{
+    int tp, sz;
+
+    if (ei_get_type (buf, &idx, &tp, &sz)) {
+        reply_badarg ();
+        return;
+    }
+
+    char *path = malloc (sz + 1);
+    assert (path != NULL);
+
+    if (ei_decode_string (buf, &idx, path)) {
+        free (path);
+        reply_badarg ();
+        return;
+    }
+
+    if (control_owner () == NULL) {
+        /* daemon clients can not follow */
+        reply_error (EOPNOTSUPP);
+    } else if (path[0] == 0) {
+        /* the new port did not take over */
+        handover_cancel (eloop);
+        reply_ok ();
+    } else if (crawl_running ()) {
+        /* crawled watches keep arriving from the worker threads */
+        reply_error (EBUSY);
+    } else if (handover_listen (eloop, path) == -1) {
         reply_error (errno);
+    } else {
+        reply_ok ();
     }
+
+    free (path);
 }
 
 /******************************************************************************/
@@ -294,4 +1476,10 @@ rm_watch (const char *buf, int idx)
 static control_func *const funcs[] = {
     [CMD_ADD_WATCH] = &add_watch,
     [CMD_RM_WATCH]  = &rm_watch,
+    [CMD_ADD_TREE]  = &add_tree,
+    [CMD_STATS]     = &stats,
+    [CMD_SET_OPT]   = &set_opt,
+    [CMD_REPLAY]    = &replay,
+    [CMD_ACTIVE]    = &active,
+    [CMD_HANDOVER]  = &handover,
 };
@@ -1,12 +1,77 @@
 #ifndef _CONTROL_H
 #define _CONTROL_H
 
+#include "checkpoint.h"
+#include "crawl.h"
 #include "evl.h"
+#include "snapshot.h"
+
+struct client;
+struct statx;
+
+/* runtime tunables */
+enum {
+    CONTROL_OPT_BATCH = 0,   /* events handled per loop iteration */
+    CONTROL_OPT_RBUF,        /* maximum command size */
+    CONTROL_OPT_SBUF,        /* send buffer size */
+    CONTROL_OPT_WRITE_MAX,   /* maximum bytes per output write */
+    CONTROL_OPT_COALESCE,    /* low priority queue size to start coalescing */
+    CONTROL_OPT_LOG_LEVEL,   /* syslog level (LOG_EMERG .. LOG_DEBUG) */
+    CONTROL_OPT_WATCH_BUDGET, /* maximum number of watches (0 - max_user_watches) */
+    CONTROL_OPT_HISTORY,     /* event history size in bytes (0 - disabled) */
+    CONTROL_OPT_ACTIVE,      /* initial event credits (command line only) */
+    CONTROL_OPT_MAX
+};
+
+extern void
+control_init (struct evl_inst *loop, int lfd);
+
+extern int
+control_set_opt (struct evl_inst *loop, int opt, unsigned long val);
+
+extern void
+control_flush (struct evl_inst *loop);
+
+extern struct client *
+control_owner (void);
+
+extern int
+control_owner_idle (void);
+
+extern void
+control_get_state (uint64_t *last_seq, long *credit);
+
+extern void
+control_set_state (uint64_t last_seq, long credit);
+
+extern void
+control_shutdown (void);
+
+extern void
+control_notify (int prio, int wd, uint32_t mask, uint32_t cookie, const char *name,
+                uint32_t len, const struct statx *stx);
+
+extern void
+control_crawl (struct client *c, unsigned int id, const struct crawl_res *res, int n);
+
+extern void
+control_crawl_done (struct client *c, unsigned int id, unsigned long watched,
+                    unsigned long failed);
+
+extern void
+control_restored (const struct checkpoint_res *res, int n);
+
+extern void
+control_ignored (struct client *c, int wd, int prio);
+
+extern void
+control_summary (struct client *c, int prio, int wd, const unsigned long counts[32],
+                 const char *const *names, unsigned int nnames, int truncated);
 
 extern void
-control_init (struct evl_inst *loop);
+control_snapshot (int wd, const struct snapshot_ent *ents, int n, int last);
 
 extern void
-control_notify (int wd, uint32_t mask, uint32_t cookie, const char *name, uint32_t len);
+control_evicted (int wd, const char *path, const char *reason);
 
 #endif /* _CONTROL_H */
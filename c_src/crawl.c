@@ -0,0 +1,500 @@
+/**
+ * @file crawl.c
+ *
+ * @brief Parallel directory tree crawler.
+ *
+ * Worker threads walk the tree with openat()/getdents64() and add a watch
+ * for every directory on the shared inotify descriptor.  Results are handed
+ * over to the event loop thread in chunks through an eventfd, so all output
+ * to the owner is still done from the loop.  Subdirectories are added with
+ * IN_ONLYDIR|IN_DONT_FOLLOW (a symlink swapped in is not followed), and the
+ * loop thread takes them from the watch budget, retrying additions that hit
+ * the kernel limit after an eviction.  Events of a directory that arrive
+ * before the loop tracks it are held by watch.c until then.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#define _GNU_SOURCE /* for TEMP_FAILURE_RETRY */
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "budget.h"
+#include "chain.h"
+#include "checkpoint.h"
+#include "control.h"
+#include "crawl.h"
+#include "log.h"
+#include "watch.h"
+
+/* maximum number of worker threads per crawl */
+#define MAX_THREADS 16
+/* number of results in a chunk passed to the loop thread */
+#define CHUNK_SZ 256
+/* getdents64 buffer size */
+#define DENTS_SZ 32768
+
+struct linux_dirent64 {
+    ino64_t        d_ino;
+    off64_t        d_off;
+    unsigned short d_reclen;
+    unsigned char  d_type;
+    char           d_name[];
+};
+
+struct chunk {
+    struct chunk     *prev;
+    struct chunk     *next;
+    int              n;
+    struct crawl_res res[CHUNK_SZ];
+};
+
+struct crawl {
+    struct crawl    *prev;
+    struct crawl    *next;
+    unsigned int    id;
+    int             ifd;
+    uint32_t        mask;
+    /* followed if it is a symlink, unlike the directories below */
+    char            *root;
+    /* requester (NULL if gone) */
+    struct client   *client;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    /* directories waiting to be scanned (stack) */
+    char            **queue;
+    size_t          qlen;
+    size_t          qcap;
+    /* number of workers scanning a directory right now */
+    int             busy;
+    /* number of workers that have not exited yet */
+    int             running;
+    /* chunks ready to be sent */
+    struct chunk    *ready;
+    unsigned long   watched;
+    unsigned long   failed;
+    int             nthreads;
+    pthread_t       threads[MAX_THREADS];
+};
+
+static struct evl_handler *eh = NULL;
+static struct crawl *crawls = NULL;
+static unsigned int last_id = 0;
+
+static void
+notify_loop (void)
+{
+    uint64_t one = 1;
+    ssize_t n = TEMP_FAILURE_RETRY (write (eh->fd, &one, sizeof (one)));
+    assert (n == sizeof (one));
+}
+
+/* Pushes `n' paths onto the crawl queue. Lock must be held. */
+static void
+queue_push (struct crawl *c, char **paths, size_t n)
+{
+    if (c->qlen + n > c->qcap) {
+        size_t cap = c->qcap ? c->qcap : 64;
+        while (cap < c->qlen + n)
+            cap *= 2;
+        c->queue = realloc (c->queue, cap * sizeof (*c->queue));
+        assert (c->queue != NULL);
+        c->qcap = cap;
+    }
+
+    memcpy (c->queue + c->qlen, paths, n * sizeof (*paths));
+    c->qlen += n;
+}
+
+/* Hands over a filled chunk to the loop thread. */
+static void
+chunk_flush (struct crawl *c, struct chunk **ch)
+{
+    if (*ch == NULL || (*ch)->n == 0)
+        return;
+
+    pthread_mutex_lock (&c->lock);
+    chain_add_tail (c->ready, *ch);
+    pthread_mutex_unlock (&c->lock);
+
+    notify_loop ();
+    *ch = NULL;
+}
+
+static void
+chunk_put (struct crawl *c, struct chunk **ch, int wd, int err, char *path)
+{
+    if (*ch == NULL) {
+        *ch = malloc (sizeof (**ch));
+        assert (*ch != NULL);
+        (*ch)->n = 0;
+    }
+
+    struct crawl_res *r = &(*ch)->res[(*ch)->n++];
+    r->wd   = wd;
+    r->err  = err;
+    r->path = path;
+
+    if ((*ch)->n == CHUNK_SZ)
+        chunk_flush (c, ch);
+}
+
+static char *
+join_path (const char *dir, const char *name)
+{
+    size_t dl = strlen (dir);
+    size_t nl = strlen (name);
+    char *p = malloc (dl + nl + 2);
+    assert (p != NULL);
+
+    memcpy (p, dir, dl);
+    if (dl == 0 || p[dl - 1] != '/')
+        p[dl++] = '/';
+    memcpy (p + dl, name, nl + 1);
+
+    return p;
+}
+
+static inline int
+is_dot (const char *name)
+{
+    return name[0] == '.'
+        && (name[1] == 0 || (name[1] == '.' && name[2] == 0));
+}
+
+/* Adds watch on the directory `path' of the crawl. */
+static int
+add_dir (struct crawl *c, const char *path)
+{
+    /* the directory may be watched by another client */
+    uint32_t mask = (c->mask & ~WATCH_SUB_FLAGS) | IN_MASK_ADD | IN_ONLYDIR;
+
+    if (strcmp (path, c->root) != 0)
+        mask |= IN_DONT_FOLLOW;
+
+    return inotify_add_watch (c->ifd, path, mask);
+}
+
+/* Adds watch on `path' and collects its subdirectories into `subs'. */
+static void
+scan_dir (struct crawl *c, char *path, struct chunk **ch,
+          char ***subs, size_t *nsubs, size_t *csubs, char *dents)
+{
+    int wd = add_dir (c, path);
+    int err = wd == -1 ? errno : 0;
+
+    int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+    if (strcmp (path, c->root) != 0)
+        flags |= O_NOFOLLOW;
+
+    int dfd = openat (AT_FDCWD, path, flags);
+    if (dfd == -1)
+        goto out;
+
+    for (;;) {
+        long n = TEMP_FAILURE_RETRY (syscall (SYS_getdents64, dfd, dents, DENTS_SZ));
+        if (n <= 0)
+            break;
+
+        for (long off = 0; off < n;) {
+            struct linux_dirent64 *d = (void *) (dents + off);
+            off += d->d_reclen;
+
+            if (is_dot (d->d_name))
+                continue;
+
+            int dir = d->d_type == DT_DIR;
+            if (d->d_type == DT_UNKNOWN) {
+                struct stat st;
+                dir = fstatat (dfd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0
+                      && S_ISDIR (st.st_mode);
+            }
+            if (!dir)
+                continue;
+
+            if (*nsubs == *csubs) {
+                *csubs = *csubs ? *csubs * 2 : 64;
+                *subs = realloc (*subs, *csubs * sizeof (**subs));
+                assert (*subs != NULL);
+            }
+            (*subs)[(*nsubs)++] = join_path (path, d->d_name);
+        }
+    }
+
+    TEMP_FAILURE_RETRY (close (dfd));
+
+out:
+    /* `path' belongs to the loop thread once it is in a chunk */
+    chunk_put (c, ch, wd, err, path);
+}
+
+static void *
+worker (void *arg)
+{
+    struct crawl *c = arg;
+    struct chunk *ch = NULL;
+    char **subs = NULL;
+    size_t csubs = 0;
+    char *dents = malloc (DENTS_SZ);
+    assert (dents != NULL);
+
+    pthread_mutex_lock (&c->lock);
+    for (;;) {
+        while (c->qlen == 0 && c->busy > 0) {
+            /* nothing to do: pass collected results before sleeping */
+            if (ch != NULL) {
+                pthread_mutex_unlock (&c->lock);
+                chunk_flush (c, &ch);
+                pthread_mutex_lock (&c->lock);
+                continue;
+            }
+            pthread_cond_wait (&c->cond, &c->lock);
+        }
+
+        if (c->qlen == 0)
+            break;
+
+        char *path = c->queue[--c->qlen];
+        c->busy++;
+        pthread_mutex_unlock (&c->lock);
+
+        size_t nsubs = 0;
+        scan_dir (c, path, &ch, &subs, &nsubs, &csubs, dents);
+
+        pthread_mutex_lock (&c->lock);
+        c->busy--;
+        if (nsubs > 0) {
+            queue_push (c, subs, nsubs);
+            pthread_cond_broadcast (&c->cond);
+        } else if (c->qlen == 0 && c->busy == 0) {
+            pthread_cond_broadcast (&c->cond);
+        }
+    }
+    pthread_mutex_unlock (&c->lock);
+
+    chunk_flush (c, &ch);
+    free (subs);
+    free (dents);
+
+    pthread_mutex_lock (&c->lock);
+    c->running--;
+    pthread_mutex_unlock (&c->lock);
+
+    notify_loop ();
+
+    return NULL;
+}
+
+static void
+crawl_free (struct crawl *c)
+{
+    for (int i = 0; i < c->nthreads; i++)
+        pthread_join (c->threads[i], NULL);
+
+    pthread_cond_destroy (&c->cond);
+    pthread_mutex_destroy (&c->lock);
+    free (c->queue);
+    free (c->root);
+    free (c);
+}
+
+static void
+send_chunks (struct crawl *c, struct chunk *ready)
+{
+    struct chunk *ch, *next;
+
+    chain_for_each_safe (ready, ch, next) {
+        for (int i = 0; i < ch->n; i++) {
+            struct crawl_res *r = &ch->res[i];
+
+            /* the kernel limit was hit: make room (from the loop thread) */
+            if (r->wd == -1 && r->err == ENOSPC && c->client != NULL
+                && budget_evict (1) == 1) {
+                r->wd  = add_dir (c, r->path);
+                r->err = r->wd == -1 ? errno : 0;
+            }
+
+            if (r->wd == -1) {
+                c->failed++;
+            } else if (c->client != NULL) {
+                int added = watch_get (r->wd) == NULL;
+                struct watch *w = watch_track (r->wd, r->path,
+                                               (c->mask & ~WATCH_SUB_FLAGS) | IN_MASK_ADD);
+                watch_subscribe (w, c->client, c->mask);
+                checkpoint_add (w);
+                /* only a new watch takes from the budget */
+                if (added)
+                    budget_check (w);
+                c->watched++;
+            } else {
+                /* nobody to deliver events to */
+                struct watch *w = watch_get (r->wd);
+                if (w == NULL)
+                    inotify_rm_watch (c->ifd, r->wd);
+            }
+        }
+
+        if (c->client != NULL)
+            control_crawl (c->client, c->id, ch->res, ch->n);
+        /* events held for the directories follow their results */
+        watch_release ();
+
+        for (int i = 0; i < ch->n; i++)
+            free (ch->res[i].path);
+        free (ch);
+    }
+}
+
+static void
+crawl_handler (struct evl_handler *eh, uint32_t _events, void *_nil)
+{
+    uint64_t cnt;
+    struct crawl *c, *next;
+
+    if (TEMP_FAILURE_RETRY (read (eh->fd, &cnt, sizeof (cnt))) == -1 && errno != EAGAIN) {
+        ERR ("read (eventfd): %s", strerror (errno));
+        return;
+    }
+
+    chain_for_each_safe (crawls, c, next) {
+        pthread_mutex_lock (&c->lock);
+        struct chunk *ready = c->ready;
+        c->ready = NULL;
+        int done = c->running == 0;
+        pthread_mutex_unlock (&c->lock);
+
+        send_chunks (c, ready);
+
+        if (done) {
+            DEBUG ("%s: crawl %u done: %lu watched, %lu failed",
+                   __func__, c->id, c->watched, c->failed);
+            if (c->client != NULL)
+                control_crawl_done (c->client, c->id, c->watched, c->failed);
+            chain_del (crawls, c);
+            crawl_free (c);
+        }
+    }
+
+    /* held events of no crawled directory once the last crawl is done */
+    watch_release ();
+}
+
+int
+crawl_init (struct evl_inst *loop)
+{
+    assert (eh == NULL);
+
+    int efd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (efd == -1) {
+        ERR ("eventfd: %s", strerror (errno));
+        return -1;
+    }
+
+    eh = evl_add (loop, efd, EPOLLIN, &crawl_handler, NULL);
+    assert (eh != NULL);
+
+    return 0;
+}
+
+void
+crawl_destroy (struct evl_inst *loop)
+{
+    if (eh != NULL) {
+        evl_del (loop, eh);
+        TEMP_FAILURE_RETRY (close (eh->fd));
+        eh = NULL;
+    }
+}
+
+/**
+ * Starts asynchronous crawl of the tree under @a root adding watches with
+ * @a mask for every directory found on behalf of the client @a client.
+ *
+ * @return crawl id reported in the result messages or -1 on error
+ */
+int
+crawl_start (int ifd, const char *root, uint32_t mask, int nthreads,
+             struct client *client)
+{
+    assert (eh != NULL);
+
+    struct stat st;
+    if (stat (root, &st) == -1)
+        return -1;
+    if (!S_ISDIR (st.st_mode)) {
+        errno = ENOTDIR;
+        return -1;
+    }
+
+    if (nthreads <= 0)
+        nthreads = sysconf (_SC_NPROCESSORS_ONLN);
+    if (nthreads <= 0)
+        nthreads = 1;
+    if (nthreads > MAX_THREADS)
+        nthreads = MAX_THREADS;
+
+    struct crawl *c = calloc (1, sizeof (*c));
+    assert (c != NULL);
+
+    c->id     = ++last_id;
+    c->ifd    = ifd;
+    c->mask   = mask & ~IN_MASK_ADD;
+    c->root   = strdup (root);
+    assert (c->root != NULL);
+    c->client = client;
+    pthread_mutex_init (&c->lock, NULL);
+    pthread_cond_init (&c->cond, NULL);
+
+    char *path = strdup (root);
+    assert (path != NULL);
+    queue_push (c, &path, 1);
+
+    c->running = nthreads;
+    for (int i = 0; i < nthreads; i++) {
+        int rc = pthread_create (&c->threads[i], NULL, &worker, c);
+        if (rc != 0) {
+            ERR ("pthread_create: %s", strerror (rc));
+            assert (i > 0);
+            pthread_mutex_lock (&c->lock);
+            c->running -= nthreads - i;
+            pthread_mutex_unlock (&c->lock);
+            break;
+        }
+        c->nthreads++;
+    }
+
+    chain_add (crawls, c);
+
+    return c->id;
+}
+
+/* Returns non-zero if any crawl is still adding watches. */
+int
+crawl_running (void)
+{
+    return crawls != NULL;
+}
+
+/* Forgets the client of its running crawls (it is gone). */
+void
+crawl_drop_client (struct client *client)
+{
+    struct crawl *c;
+
+    chain_for_each (crawls, c) {
+        if (c->client == client)
+            c->client = NULL;
+    }
+}
@@ -0,0 +1,31 @@
+#ifndef _CRAWL_H
+#define _CRAWL_H
+
+#include "evl.h"
+
+struct client;
+
+/* single crawl result: watch descriptor or error code for the path */
+struct crawl_res {
+    int  wd;    /* -1 on error */
+    int  err;   /* errno if wd == -1 */
+    char *path;
+};
+
+extern int
+crawl_init (struct evl_inst *loop);
+
+extern void
+crawl_destroy (struct evl_inst *loop);
+
+extern int
+crawl_start (int ifd, const char *root, uint32_t mask, int nthreads,
+             struct client *client);
+
+extern int
+crawl_running (void);
+
+extern void
+crawl_drop_client (struct client *client);
+
+#endif /* _CRAWL_H */
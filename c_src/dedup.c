@@ -0,0 +1,310 @@
+/**
+ * @file dedup.c
+ *
+ * @brief Content hash based suppression of IN_CLOSE_WRITE events.
+ *
+ * Files are hashed with XXH64 on close-write; the last hash is cached per
+ * watch and inode (a file seen through two watches is compared on each on
+ * its own) and the event is reported as unchanged if the content is the same.
+ * Hashing is done on the loop thread, so larger files are not checked (their
+ * events are always reported).
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#define _GNU_SOURCE /* for TEMP_FAILURE_RETRY */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "chain.h"
+#include "dedup.h"
+#include "log.h"
+
+/* read buffer size */
+#define HBUF_SZ 65536
+/* maximum size of a hashed file */
+#define HASH_MAX (4 << 20)
+/* number of cache buckets */
+#define NBUCKETS 4096
+/* maximum number of cached inodes (the cache is dropped when exceeded) */
+#define MAX_ENTRIES 65536
+
+/* XXH64 primes */
+#define P1 11400714785074694791ULL
+#define P2 14029467366897019727ULL
+#define P3  1609587929392839161ULL
+#define P4  9650029242287828579ULL
+#define P5  2870177450012600261ULL
+
+struct xxh64 {
+    uint64_t v[4];
+    uint64_t total;
+    uint8_t  mem[32];
+    size_t   memsz;
+};
+
+struct entry {
+    struct entry *prev;
+    struct entry *next;
+    int          wd;
+    dev_t        dev;
+    ino_t        ino;
+    off_t        size;
+    uint64_t     hash;
+};
+
+static struct entry *buckets[NBUCKETS];
+static unsigned long nentries = 0;
+static struct dedup_stats stats;
+static char hbuf[HBUF_SZ];
+
+static inline uint64_t
+rotl (uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t
+read64 (const uint8_t *p)
+{
+    uint64_t v;
+    memcpy (&v, p, sizeof (v));
+    return le64toh (v);
+}
+
+static inline uint32_t
+read32 (const uint8_t *p)
+{
+    uint32_t v;
+    memcpy (&v, p, sizeof (v));
+    return le32toh (v);
+}
+
+static inline uint64_t
+xxh_round (uint64_t acc, uint64_t input)
+{
+    acc += input * P2;
+    acc = rotl (acc, 31);
+    return acc * P1;
+}
+
+static inline uint64_t
+xxh_merge (uint64_t acc, uint64_t val)
+{
+    acc ^= xxh_round (0, val);
+    return acc * P1 + P4;
+}
+
+static void
+xxh_init (struct xxh64 *s)
+{
+    s->v[0]  = P1 + P2;
+    s->v[1]  = P2;
+    s->v[2]  = 0;
+    s->v[3]  = -P1;
+    s->total = 0;
+    s->memsz = 0;
+}
+
+static inline void
+xxh_stripe (struct xxh64 *s, const uint8_t *p)
+{
+    s->v[0] = xxh_round (s->v[0], read64 (p));
+    s->v[1] = xxh_round (s->v[1], read64 (p + 8));
+    s->v[2] = xxh_round (s->v[2], read64 (p + 16));
+    s->v[3] = xxh_round (s->v[3], read64 (p + 24));
+}
+
+static void
+xxh_update (struct xxh64 *s, const uint8_t *p, size_t len)
+{
+    const uint8_t *end = p + len;
+
+    s->total += len;
+
+    if (s->memsz + len < 32) {
+        memcpy (s->mem + s->memsz, p, len);
+        s->memsz += len;
+        return;
+    }
+
+    if (s->memsz) {
+        size_t fill = 32 - s->memsz;
+        memcpy (s->mem + s->memsz, p, fill);
+        xxh_stripe (s, s->mem);
+        p += fill;
+        s->memsz = 0;
+    }
+
+    for (; p + 32 <= end; p += 32)
+        xxh_stripe (s, p);
+
+    s->memsz = end - p;
+    memcpy (s->mem, p, s->memsz);
+}
+
+static uint64_t
+xxh_digest (const struct xxh64 *s)
+{
+    const uint8_t *p = s->mem;
+    const uint8_t *end = p + s->memsz;
+    uint64_t h;
+
+    if (s->total >= 32) {
+        h = rotl (s->v[0], 1) + rotl (s->v[1], 7)
+          + rotl (s->v[2], 12) + rotl (s->v[3], 18);
+        for (int i = 0; i < 4; i++)
+            h = xxh_merge (h, s->v[i]);
+    } else {
+        h = s->v[2] + P5;
+    }
+
+    h += s->total;
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= xxh_round (0, read64 (p));
+        h = rotl (h, 27) * P1 + P4;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t) read32 (p) * P1;
+        h = rotl (h, 23) * P2 + P3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * P5;
+        h = rotl (h, 11) * P1;
+    }
+
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+static inline uint64_t
+now_ns (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Hashes content of the open file (fails with EFBIG above HASH_MAX bytes,
+ * the file may grow while being read). */
+static int
+hash_fd (int fd, uint64_t *hash)
+{
+    struct xxh64 s;
+    xxh_init (&s);
+
+    for (;;) {
+        ssize_t n = TEMP_FAILURE_RETRY (read (fd, hbuf, HBUF_SZ));
+        if (n == -1)
+            return -1;
+        if (n == 0)
+            break;
+        xxh_update (&s, (const uint8_t *) hbuf, n);
+        if (s.total > HASH_MAX) {
+            errno = EFBIG;
+            return -1;
+        }
+    }
+
+    *hash = xxh_digest (&s);
+    return 0;
+}
+
+static void
+cache_drop (void)
+{
+    for (int i = 0; i < NBUCKETS; i++) {
+        while (buckets[i]) {
+            struct entry *e = buckets[i];
+            chain_del (buckets[i], e);
+            free (e);
+        }
+    }
+    nentries = 0;
+}
+
+/**
+ * Checks whether content of the file at @a path is the same as it was on
+ * the previous call for the same watch @a wd and inode.
+ *
+ * @return 1 if the content did not change, 0 otherwise (or on error)
+ */
+int
+dedup_unchanged (int wd, const char *path)
+{
+    int fd = open (path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC | O_NOCTTY | O_NONBLOCK);
+    if (fd == -1) {
+        DEBUG ("%s: open (%s): %s", __func__, path, strerror (errno));
+        return 0;
+    }
+
+    struct stat st;
+    if (fstat (fd, &st) == -1 || !S_ISREG (st.st_mode) || st.st_size > HASH_MAX) {
+        TEMP_FAILURE_RETRY (close (fd));
+        return 0;
+    }
+
+    uint64_t t0 = now_ns ();
+    uint64_t hash;
+    int rc = hash_fd (fd, &hash);
+    stats.hash_ns += now_ns () - t0;
+    TEMP_FAILURE_RETRY (close (fd));
+
+    if (rc == -1) {
+        DEBUG ("%s: read (%s): %s", __func__, path, strerror (errno));
+        return 0;
+    }
+    stats.hashed++;
+
+    struct entry **b = &buckets[(st.st_ino ^ st.st_dev ^ wd) % NBUCKETS];
+    struct entry *e;
+
+    chain_for_each (*b, e) {
+        if (e->ino == st.st_ino && e->dev == st.st_dev && e->wd == wd)
+            break;
+    }
+
+    if (e != NULL) {
+        if (e->size == st.st_size && e->hash == hash) {
+            stats.suppressed++;
+            return 1;
+        }
+    } else {
+        if (nentries >= MAX_ENTRIES)
+            cache_drop ();
+
+        e = malloc (sizeof (*e));
+        assert (e != NULL);
+        e->wd  = wd;
+        e->dev = st.st_dev;
+        e->ino = st.st_ino;
+        chain_add (*b, e);
+        nentries++;
+    }
+
+    e->size = st.st_size;
+    e->hash = hash;
+
+    return 0;
+}
+
+void
+dedup_get_stats (struct dedup_stats *st)
+{
+    *st = stats;
+}
@@ -0,0 +1,21 @@
+#ifndef _DEDUP_H
+#define _DEDUP_H
+
+#include <stdint.h>
+
+struct dedup_stats {
+    /* number of files hashed */
+    unsigned long hashed;
+    /* total time spent hashing (nanoseconds) */
+    uint64_t      hash_ns;
+    /* number of IN_CLOSE_WRITE events suppressed */
+    unsigned long suppressed;
+};
+
+extern int
+dedup_unchanged (int wd, const char *path);
+
+extern void
+dedup_get_stats (struct dedup_stats *st);
+
+#endif /* _DEDUP_H */
@@ -0,0 +1,317 @@
+/**
+ * @file encode.c
+ *
+ * @brief Event encoder.
+ *
+ * Every event is {einotify, Wd, Mask, Cookie, Name, Stat, Seq} and only the
+ * integers and the name change between events.  encode_init() builds the
+ * constant parts with ei once; encode_event() copies them and writes the
+ * integers and the name directly, producing the same bytes as the ei based
+ * encode_event_ei().  The integer encoding limits are probed from ei at
+ * startup, and if the output of both encoders differs for any of the probe
+ * events the fast path is disabled.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <ei.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "encode.h"
+#include "log.h"
+
+/* pre-encoded version, tuple header and 'einotify' atom */
+static char hdr[ENCODE_HDR_MAX];
+static int hdr_len = 0;
+/* pre-encoded 'undefined' atom */
+static char undef[16];
+static int undef_len = 0;
+/* largest value ei encodes as INTEGER_EXT (larger ones are bignums) */
+static unsigned long int_max = (1UL << 27) - 1;
+/* fast path is verified to match ei */
+static int fast = 0;
+
+static const char *
+stat_type (const struct statx *stx)
+{
+    switch (stx->stx_mode & S_IFMT) {
+    case S_IFREG: return "regular";
+    case S_IFDIR: return "directory";
+    case S_IFLNK: return "symlink";
+    case S_IFCHR:
+    case S_IFBLK: return "device";
+    default:      return "other";
+    }
+}
+
+/* Encodes #einotify_stat{} record or 'undefined'. */
+static void
+encode_stat (char *buf, int *idx, const struct statx *stx)
+{
+    int rc;
+
+    if (stx == NULL) {
+        rc = ei_encode_atom (buf, idx, "undefined");
+        assert (rc == 0);
+        return;
+    }
+
+    rc = ei_encode_tuple_header (buf, idx, 5);
+    assert (rc == 0);
+    rc = ei_encode_atom (buf, idx, "einotify_stat");
+    assert (rc == 0);
+    rc = ei_encode_atom (buf, idx, stat_type (stx));
+    assert (rc == 0);
+    rc = ei_encode_ulonglong (buf, idx, stx->stx_size);
+    assert (rc == 0);
+    rc = ei_encode_longlong (buf, idx, stx->stx_mtime.tv_sec);
+    assert (rc == 0);
+    rc = ei_encode_ulonglong (buf, idx, stx->stx_ino);
+    assert (rc == 0);
+}
+
+static inline size_t
+name_len (const char *name, uint32_t len)
+{
+    return len ? strnlen (name, len) : 0;
+}
+
+/**
+ * Encodes the event with ei (reference implementation).
+ *
+ * @return encoded size or -1 if @a sz is too small
+ */
+int
+encode_event_ei (char *buf, size_t sz, int wd, uint32_t mask, uint32_t cookie,
+                 const char *name, uint32_t len, const struct statx *stx,
+                 uint64_t seq)
+{
+    int rc, idx = 0;
+    size_t nl = name_len (name, len);
+
+    if (sz < ENCODE_EVENT_MAX - ENCODE_NAME_MAX + 3 + nl)
+        return -1;
+
+    rc = ei_encode_version (buf, &idx);
+    assert (rc == 0);
+    rc = ei_encode_tuple_header (buf, &idx, 7);
+    assert (rc == 0);
+
+    rc = ei_encode_atom (buf, &idx, "einotify");
+    assert (rc == 0);
+    rc = ei_encode_long (buf, &idx, wd);
+    assert (rc == 0);
+    rc = ei_encode_ulong (buf, &idx, mask);
+    assert (rc == 0);
+    rc = ei_encode_ulong (buf, &idx, cookie);
+    assert (rc == 0);
+    if (nl)
+        rc = ei_encode_string_len (buf, &idx, name, nl);
+    else
+        rc = ei_encode_empty_list (buf, &idx);
+    assert (rc == 0);
+    encode_stat (buf, &idx, stx);
+    rc = ei_encode_ulonglong (buf, &idx, seq);
+    assert (rc == 0);
+
+    return idx;
+}
+
+static inline char *
+put_ulong (char *s, unsigned long v)
+{
+    if (v < 256) {
+        *s++ = ERL_SMALL_INTEGER_EXT;
+        *s++ = v;
+    } else if (v <= int_max) {
+        *s++ = ERL_INTEGER_EXT;
+        *s++ = v >> 24;
+        *s++ = v >> 16;
+        *s++ = v >> 8;
+        *s++ = v;
+    } else {
+        char *arity = s + 1;
+        *s++ = ERL_SMALL_BIG_EXT;
+        s++;
+        *s++ = 0; /* sign */
+        *arity = 0;
+        while (v) {
+            *s++ = v & 0xff;
+            v >>= 8;
+            (*arity)++;
+        }
+    }
+
+    return s;
+}
+
+/* Encodes watch descriptor (negative for poll mode watches). */
+static inline char *
+put_long (char *s, long v)
+{
+    if (v >= 0)
+        return put_ulong (s, v);
+
+    if (v >= -(long) int_max - 1) {
+        *s++ = ERL_INTEGER_EXT;
+        *s++ = v >> 24;
+        *s++ = v >> 16;
+        *s++ = v >> 8;
+        *s++ = v;
+        return s;
+    }
+
+    char *arity = s + 1;
+    unsigned long u = -(unsigned long) v;
+    *s++ = ERL_SMALL_BIG_EXT;
+    s++;
+    *s++ = 1; /* sign */
+    *arity = 0;
+    while (u) {
+        *s++ = u & 0xff;
+        u >>= 8;
+        (*arity)++;
+    }
+
+    return s;
+}
+
+/**
+ * Encodes the event using pre-encoded templates.
+ *
+ * @return encoded size or -1 if @a sz is too small
+ */
+int
+encode_event (char *buf, size_t sz, int wd, uint32_t mask, uint32_t cookie,
+              const char *name, uint32_t len, const struct statx *stx,
+              uint64_t seq)
+{
+    if (!fast)
+        return encode_event_ei (buf, sz, wd, mask, cookie, name, len, stx, seq);
+
+    size_t nl = name_len (name, len);
+
+    if (sz < ENCODE_EVENT_MAX - ENCODE_NAME_MAX + 3 + nl)
+        return -1;
+
+    char *s = buf;
+
+    memcpy (s, hdr, hdr_len);
+    s += hdr_len;
+
+    s = put_long (s, wd);
+    s = put_ulong (s, mask);
+    s = put_ulong (s, cookie);
+
+    if (nl) {
+        *s++ = ERL_STRING_EXT;
+        *s++ = nl >> 8;
+        *s++ = nl;
+        memcpy (s, name, nl);
+        s += nl;
+    } else {
+        *s++ = ERL_NIL_EXT;
+    }
+
+    if (stx == NULL) {
+        memcpy (s, undef, undef_len);
+        s += undef_len;
+    } else {
+        int idx = s - buf;
+        encode_stat (buf, &idx, stx);
+        s = buf + idx;
+    }
+
+    s = put_ulong (s, seq);
+
+    return s - buf;
+}
+
+/**
+ * Returns the encoded size of the sequence number, the last element of an
+ * encoded event.
+ */
+int
+encode_seq_len (uint64_t seq)
+{
+    int idx = 0;
+    int rc = ei_encode_ulonglong (NULL, &idx, seq);
+    assert (rc == 0);
+
+    return idx;
+}
+
+/* Returns non-zero if both encoders produce the same bytes. */
+static int
+check (int wd, uint32_t mask, uint32_t cookie, const char *name, uint32_t len)
+{
+    char a[ENCODE_EVENT_MAX], b[ENCODE_EVENT_MAX];
+    uint64_t seq = (uint64_t) mask << 32 | cookie;
+
+    int na = encode_event (a, sizeof (a), wd, mask, cookie, name, len, NULL, seq);
+    int nb = encode_event_ei (b, sizeof (b), wd, mask, cookie, name, len, NULL, seq);
+
+    return na == nb && memcmp (a, b, na) == 0;
+}
+
+/**
+ * Builds templates and verifies the fast encoder against ei.
+ *
+ * @return 0 if the fast encoder is used, -1 if it falls back to ei
+ */
+int
+encode_init (void)
+{
+    int rc, idx = 0;
+
+    rc = ei_encode_version (hdr, &idx);
+    assert (rc == 0);
+    rc = ei_encode_tuple_header (hdr, &idx, 7);
+    assert (rc == 0);
+    rc = ei_encode_atom (hdr, &idx, "einotify");
+    assert (rc == 0);
+    assert (idx <= ENCODE_HDR_MAX);
+    hdr_len = idx;
+
+    idx = 0;
+    rc = ei_encode_atom (undef, &idx, "undefined");
+    assert (rc == 0);
+    undef_len = idx;
+
+    /* ei encodes integers up to 2^27 - 1 or up to 2^31 - 1 as INTEGER_EXT
+     * depending on its version */
+    char tmp[16];
+    idx = 0;
+    ei_encode_ulong (tmp, &idx, 1UL << 27);
+    int_max = tmp[0] == ERL_INTEGER_EXT ? 0x7fffffffUL : (1UL << 27) - 1;
+
+    static const unsigned long ints[] = {
+        0, 1, 255, 256, 65535, 65536, (1UL << 27) - 1, 1UL << 27,
+        0x7fffffffUL, 0x80000000UL, 0xffffffffUL,
+    };
+    static const char long_name[] =
+        "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"
+        "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"
+        "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcdef"
+        "0123456789abcdef0123456789abcdef0123456789abcdef0123456789abcde";
+
+    fast = 1;
+    for (unsigned int i = 0; i < sizeof (ints) / sizeof (ints[0]) && fast; i++) {
+        fast = check (ints[i], ints[i], ints[i], "x\0\0\0", 4)
+            && check (1, ints[i], 0, "", 0)
+            && check (-2, ints[i], 0, long_name, sizeof (long_name))
+            && check (-(long) ints[i] - 1, 0, 0, "", 0);
+    }
+
+    if (!fast) {
+        WARNING ("fast event encoder does not match ei, using ei");
+        return -1;
+    }
+
+    return 0;
+}
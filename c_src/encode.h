@@ -0,0 +1,34 @@
+#ifndef _ENCODE_H
+#define _ENCODE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct statx;
+
+/* upper bound of an encoded #einotify{} event:
+ * header (version, tuple, atom) + 4 integers + name + #einotify_stat{} */
+#define ENCODE_HDR_MAX   32
+#define ENCODE_INT_MAX   11   /* SMALL_BIG_EXT with 8 digits */
+#define ENCODE_NAME_MAX  (3 + 255)
+#define ENCODE_STAT_MAX  64
+#define ENCODE_EVENT_MAX (ENCODE_HDR_MAX + 4 * ENCODE_INT_MAX \
+                          + ENCODE_NAME_MAX + ENCODE_STAT_MAX)
+
+extern int
+encode_init (void);
+
+extern int
+encode_event (char *buf, size_t sz, int wd, uint32_t mask, uint32_t cookie,
+              const char *name, uint32_t len, const struct statx *stx,
+              uint64_t seq);
+
+extern int
+encode_event_ei (char *buf, size_t sz, int wd, uint32_t mask, uint32_t cookie,
+                 const char *name, uint32_t len, const struct statx *stx,
+                 uint64_t seq);
+
+extern int
+encode_seq_len (uint64_t seq);
+
+#endif /* _ENCODE_H */
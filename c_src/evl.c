@@ -18,6 +18,7 @@
 #include <zmq.h>
 
 #include "evl.h"
+#include "evl_uring.h"
 #include "chain.h"
 
 /**
@@ -44,16 +45,24 @@ evl_init (int max_events, evl_hook_fn loop_start, evl_hook_fn loop_end)
     return NULL;
   }
 
-  inst = malloc (sizeof (*inst) + max_events * sizeof (struct epoll_event));
+  inst = malloc (sizeof (*inst));
   if (!inst) {
     errno = ENOMEM;
     return NULL;
   }
 
+  inst->events = malloc (max_events * sizeof (struct epoll_event));
+  if (!inst->events) {
+    free (inst);
+    errno = ENOMEM;
+    return NULL;
+  }
+
   inst->fd = epoll_create (max_events);
   if (inst->fd < 0) {
     error = errno;
     perror ("epoll_create");
+    free (inst->events);
     free (inst);
     errno = error;
     return NULL;
@@ -63,6 +72,10 @@ evl_init (int max_events, evl_hook_fn loop_start, evl_hook_fn loop_end)
   inst->cl         = NULL;
   inst->flags      = 0;
   inst->max_events = max_events;
+  inst->next_max_events = 0;
+#ifdef EVL_URING
+  inst->uring      = NULL;
+#endif /* EVL_URING */
 
   inst->loop_start = loop_start;
   inst->loop_end   = loop_end;
@@ -70,6 +83,61 @@ evl_init (int max_events, evl_hook_fn loop_start, evl_hook_fn loop_end)
   return inst;
 }
 
+#ifdef EVL_URING
+/**
+ * Same as evl_init() but uses io_uring instead of epoll.
+ *
+ * @return data structure to be used by all other functions or NULL on error
+ *         (e.g. io_uring is not supported by the kernel, errno is set);
+ *         the caller may fall back to evl_init()
+ */
+struct evl_inst *
+evl_init_uring (int max_events, evl_hook_fn loop_start, evl_hook_fn loop_end)
+{
+  int error;
+  struct evl_inst *inst;
+
+  if (max_events <= 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  inst = malloc (sizeof (*inst));
+  if (!inst) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  inst->events = malloc (max_events * sizeof (struct epoll_event));
+  if (!inst->events) {
+    free (inst);
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  inst->fd         = -1;
+  inst->list       = NULL;
+  inst->cl         = NULL;
+  inst->flags      = 0;
+  inst->max_events = max_events;
+  inst->next_max_events = 0;
+  inst->uring      = NULL;
+
+  inst->loop_start = loop_start;
+  inst->loop_end   = loop_end;
+
+  if (evl_uring_setup (inst) < 0) {
+    error = errno;
+    free (inst->events);
+    free (inst);
+    errno = error;
+    return NULL;
+  }
+
+  return inst;
+}
+#endif /* EVL_URING */
+
 /**
  * Frees structures for removed file descriptors.
  *
@@ -78,10 +146,12 @@ evl_init (int max_events, evl_hook_fn loop_start, evl_hook_fn loop_end)
 static void
 evl_cleanup (struct evl_inst *inst)
 {
-  struct evl_handler *eh;
+  struct evl_handler *eh, *next;
 
-  while (inst->cl) {
-    eh = inst->cl;
+  chain_for_each_safe (inst->cl, eh, next) {
+    /* wait for the cancelled poll request to complete */
+    if (eh->flags & EVL_HF_ARMED)
+      continue;
     chain_del (inst->cl, eh);
     free (eh);
   }
@@ -133,6 +203,27 @@ evl_start (struct evl_inst *inst)
   inst->flags |= EVL_IF_RUNNING;
 
   do {
+    if (inst->next_max_events) {
+      struct epoll_event *ev = realloc (inst->events,
+                                        inst->next_max_events * sizeof (*ev));
+      if (ev) {
+        inst->events     = ev;
+        inst->max_events = inst->next_max_events;
+      } else {
+        perror ("realloc");
+      }
+      inst->next_max_events = 0;
+    }
+
+#ifdef EVL_URING
+    if (inst->uring) {
+      if (evl_uring_iter (inst) < 0)
+        return -1;
+      evl_cleanup (inst);
+      continue;
+    }
+#endif /* EVL_URING */
+
     n = TEMP_FAILURE_RETRY (
           epoll_wait (inst->fd, inst->events, inst->max_events, -1)
         );
@@ -179,6 +270,29 @@ evl_stop (struct evl_inst *inst)
   inst->flags &= ~EVL_IF_RUNNING;
 }
 
+/**
+ * Changes maximum number of events handled per loop iteration. The new
+ * value takes effect on the next iteration.
+ *
+ * @param inst        data structure pointer returned by evl_init()
+ *
+ * @param max_events  maximum number of events returned by epoll_wait()
+ *
+ * @return 0 on success, -1 on error
+ */
+int
+evl_set_max_events (struct evl_inst *inst, int max_events)
+{
+  if (max_events <= 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  inst->next_max_events = max_events;
+
+  return 0;
+}
+
 /**
  * Close epoll file descriptor and free allocated data structures.
  *
@@ -189,7 +303,12 @@ evl_destroy (struct evl_inst *inst)
 {
   struct evl_handler *eh;
 
-  close (inst->fd);
+#ifdef EVL_URING
+  if (inst->uring)
+    evl_uring_destroy (inst);
+  else
+#endif /* EVL_URING */
+    close (inst->fd);
 
   while (inst->list) {
     eh = inst->list;
@@ -197,8 +316,13 @@ evl_destroy (struct evl_inst *inst)
     free (eh);
   }
 
-  evl_cleanup (inst);
+  while (inst->cl) {
+    eh = inst->cl;
+    chain_del (inst->cl, eh);
+    free (eh);
+  }
 
+  free (inst->events);
   free (inst);
 }
 
@@ -219,20 +343,34 @@ evl_add (struct evl_inst *inst,
 
   memset (eh, 0, sizeof (*eh));
 
-  ev.events   = events;
-  ev.data.ptr = eh;
-  if (epoll_ctl (inst->fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
-    int tmp = errno;
-    perror ("EPOLL_CTL_ADD");
-    free (eh);
-    errno = tmp;
-    return NULL;
-  }
-
   eh->fd    = fd;
   eh->fn    = fun;
   eh->data  = user_data;
-  eh->flags = EVL_HF_ALIVE;
+
+#ifdef EVL_URING
+  eh->events = events;
+  if (inst->uring) {
+    if (evl_uring_add (inst, eh) < 0) {
+      int tmp = errno;
+      free (eh);
+      errno = tmp;
+      return NULL;
+    }
+  } else
+#endif /* EVL_URING */
+  {
+    ev.events   = events;
+    ev.data.ptr = eh;
+    if (epoll_ctl (inst->fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      int tmp = errno;
+      perror ("EPOLL_CTL_ADD");
+      free (eh);
+      errno = tmp;
+      return NULL;
+    }
+  }
+
+  eh->flags |= EVL_HF_ALIVE;
   chain_add (inst->list, eh);
 
   return eh;
@@ -303,6 +441,14 @@ evl_mod (struct evl_inst *inst, struct evl_handler *eh, uint32_t events)
 {
   struct epoll_event ev;
 
+#ifdef EVL_URING
+  if (inst->uring) {
+    evl_uring_mod (inst, eh, events);
+    return 0;
+  }
+  eh->events = events;
+#endif /* EVL_URING */
+
   ev.events   = events;
   ev.data.ptr = eh;
 
@@ -329,6 +475,11 @@ evl_mod_fd (struct evl_inst *inst, int fd, uint32_t events)
 void
 evl_del (struct evl_inst *inst, struct evl_handler *eh)
 {
+#ifdef EVL_URING
+  if (inst->uring)
+    evl_uring_del (inst, eh);
+  else
+#endif /* EVL_URING */
   if (epoll_ctl (inst->fd, EPOLL_CTL_DEL, eh->fd, NULL) < 0) {
     perror ("EPOLL_CTL_DEL");
   }
@@ -351,3 +502,32 @@ evl_del_fd (struct evl_inst *inst, int fd)
 
   return 0;
 }
+
+/**
+ * Writes @a count bytes from @a buf to @a fd and calls @a fun with the
+ * result. With the epoll engine the write is done (and @a fun is called)
+ * immediately; with the io_uring engine it is queued and submitted on the
+ * next loop iteration, so @a buf must stay valid until @a fun is called.
+ *
+ * @return 0 if the write was started, -1 on error
+ */
+int
+evl_write (struct evl_inst *inst,
+           int fd,
+           const void *buf,
+           size_t count,
+           evl_wcb_fn fun,
+           void *user_data)
+{
+  ssize_t n;
+
+#ifdef EVL_URING
+  if (inst->uring)
+    return evl_uring_write (inst, fd, buf, count, fun, user_data);
+#endif /* EVL_URING */
+
+  n = TEMP_FAILURE_RETRY (write (fd, buf, count));
+  (*fun) (inst, n < 0 ? -errno : (int) n, user_data);
+
+  return 0;
+}
@@ -5,18 +5,36 @@
 #include <config.h>
 #endif /* HAVE_CONFIG_H */
 
+#include <stddef.h>
 #include <stdint.h>
 #include <sys/epoll.h>
 
 //#define EVL_ZMQ
 #undef EVL_ZMQ /* FIXME: move it to config.h */
 
+/* io_uring engine, built if the kernel headers provide it (add -DEVL_NO_URING
+ * to CFLAGS in rebar.config to leave it out) */
+#if !defined (EVL_NO_URING) && defined (__has_include)
+#if __has_include (<linux/io_uring.h>)
+#define EVL_URING
+#endif
+#endif
+
 struct evl_handler;
+struct evl_inst;
+#ifdef EVL_URING
+struct evl_uring;
+#endif /* EVL_URING */
 
 typedef void (evl_hcb_fn) (struct evl_handler *eh,
                            uint32_t events,
                            void *user_data);
 
+/* write completion callback: res is number of bytes written or -errno */
+typedef void (evl_wcb_fn) (struct evl_inst *inst,
+                           int res,
+                           void *user_data);
+
 struct evl_handler {
   /* chain */
   struct evl_handler *prev;
@@ -35,11 +53,15 @@ struct evl_handler {
   void               *data;
   /* flags */
   int                flags;
+#ifdef EVL_URING
+  /* requested events */
+  uint32_t           events;
+#endif /* EVL_URING */
 };
 
 #define EVL_HF_ALIVE (1 << 0)
-
-struct evl_inst;
+#define EVL_HF_ARMED (1 << 1) /* poll request is in flight (io_uring) */
+#define EVL_HF_CANCEL (1 << 2) /* its cancellation is not submitted yet */
 
 typedef void (evl_hook_fn) (struct evl_inst *);
 
@@ -50,11 +72,17 @@ struct evl_inst {
   struct evl_handler *list;
   /* cleanup list */
   struct evl_handler *cl;
-  /* epoll fd */
+  /* epoll fd (-1 for io_uring engine) */
   int                fd;
   int                flags;
+#ifdef EVL_URING
+  /* io_uring engine state (NULL for epoll engine) */
+  struct evl_uring   *uring;
+#endif /* EVL_URING */
   int                max_events;
-  struct epoll_event events[0]; /* variable sized array (see evl_init) */
+  /* new max_events value to apply on the next iteration (0 - none) */
+  int                next_max_events;
+  struct epoll_event *events; /* max_events sized array (see evl_init) */
 };
 
 #define EVL_IF_RUNNING (1 << 0)
@@ -62,12 +90,20 @@ struct evl_inst {
 extern struct evl_inst *
 evl_init (int max_events, evl_hook_fn loop_start, evl_hook_fn loop_end);
 
+#ifdef EVL_URING
+extern struct evl_inst *
+evl_init_uring (int max_events, evl_hook_fn loop_start, evl_hook_fn loop_end);
+#endif /* EVL_URING */
+
 extern int
 evl_start (struct evl_inst *inst);
 
 extern void
 evl_stop (struct evl_inst *inst);
 
+extern int
+evl_set_max_events (struct evl_inst *inst, int max_events);
+
 extern void
 evl_destroy (struct evl_inst *inst);
 
@@ -102,4 +138,12 @@ evl_del (struct evl_inst *inst, struct evl_handler *eh);
 extern int
 evl_del_fd (struct evl_inst *inst, int fd);
 
+extern int
+evl_write (struct evl_inst *inst,
+           int fd,
+           const void *buf,
+           size_t count,
+           evl_wcb_fn fun,
+           void *user_data);
+
 #endif /* _EVL_H */
@@ -0,0 +1,465 @@
+/**
+ * @file evl_uring.c
+ *
+ * @brief io_uring engine for the event loop.
+ *
+ * Handlers are armed with one-shot IORING_OP_POLL_ADD requests and re-armed
+ * after the callback, which gives the same level-triggered behaviour as the
+ * epoll engine.  Writes are queued as IORING_OP_WRITE requests; all pending
+ * submissions (re-arms and writes) go to the kernel in the same
+ * io_uring_enter() call that waits for completions, and completions are
+ * reaped in batches of up to max_events.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#define _GNU_SOURCE /* for TEMP_FAILURE_RETRY */
+
+#include "evl.h"
+
+#ifdef EVL_URING
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "chain.h"
+#include "evl_uring.h"
+
+/* user_data tags (pointers are at least 8 byte aligned) */
+#define UD_POLL   0UL
+#define UD_WRITE  1UL
+#define UD_IGNORE 2UL
+#define UD_TAG(ud) ((ud) & 3UL)
+#define UD_PTR(ud) ((void *) (uintptr_t) ((ud) & ~3UL))
+
+struct evl_uring {
+  int                 fd;
+  /* submission queue */
+  unsigned            *sq_head;
+  unsigned            *sq_tail;
+  unsigned            *sq_mask;
+  unsigned            *sq_array;
+  unsigned            sq_entries;
+  struct io_uring_sqe *sqes;
+  /* local tail and number of not yet submitted entries */
+  unsigned            tail;
+  unsigned            pending;
+  /* completion queue */
+  unsigned            *cq_head;
+  unsigned            *cq_tail;
+  unsigned            *cq_mask;
+  struct io_uring_cqe *cqes;
+  /* mappings */
+  void                *sq_ptr;
+  size_t              sq_sz;
+  void                *cq_ptr;
+  size_t              cq_sz;
+  size_t              sqes_sz;
+  /* handlers with EVL_HF_CANCEL set */
+  unsigned            ncancel;
+};
+
+struct write_req {
+  evl_wcb_fn *fn;
+  void       *data;
+};
+
+static inline int
+sys_setup (unsigned entries, struct io_uring_params *p)
+{
+  return (int) syscall (__NR_io_uring_setup, entries, p);
+}
+
+static inline int
+sys_enter (int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+  return (int) syscall (__NR_io_uring_enter, fd, to_submit, min_complete,
+                        flags, NULL, 0);
+}
+
+/**
+ * Submits pending entries and optionally waits for @a wait completions.
+ */
+static int
+uring_enter (struct evl_uring *u, unsigned wait)
+{
+  __atomic_store_n (u->sq_tail, u->tail, __ATOMIC_RELEASE);
+
+  for (;;) {
+    int n = sys_enter (u->fd, u->pending, wait,
+                       wait ? IORING_ENTER_GETEVENTS : 0);
+    if (n >= 0) {
+      u->pending -= n;
+      if (u->pending == 0 || wait == 0)
+        return 0;
+      continue;
+    }
+    if (errno == EINTR)
+      continue;
+    /* completion queue is full: let the caller reap it */
+    if (errno == EBUSY || errno == EAGAIN)
+      return 0;
+    perror ("io_uring_enter");
+    return -1;
+  }
+}
+
+static struct io_uring_sqe *
+get_sqe (struct evl_uring *u)
+{
+  unsigned head = __atomic_load_n (u->sq_head, __ATOMIC_ACQUIRE);
+
+  if (u->tail - head >= u->sq_entries) {
+    uring_enter (u, 0);
+    head = __atomic_load_n (u->sq_head, __ATOMIC_ACQUIRE);
+    if (u->tail - head >= u->sq_entries)
+      return NULL;
+  }
+
+  unsigned idx = u->tail & *u->sq_mask;
+  struct io_uring_sqe *sqe = &u->sqes[idx];
+
+  memset (sqe, 0, sizeof (*sqe));
+  u->sq_array[idx] = idx;
+  u->tail++;
+  u->pending++;
+
+  return sqe;
+}
+
+static int
+arm (struct evl_uring *u, struct evl_handler *eh)
+{
+  struct io_uring_sqe *sqe = get_sqe (u);
+
+  if (!sqe) {
+    errno = EBUSY;
+    return -1;
+  }
+
+  sqe->opcode      = IORING_OP_POLL_ADD;
+  sqe->fd          = eh->fd;
+  sqe->poll_events = eh->events;
+  sqe->user_data   = (uintptr_t) eh | UD_POLL;
+
+  eh->flags |= EVL_HF_ARMED;
+
+  return 0;
+}
+
+static void
+disarm (struct evl_uring *u, struct evl_handler *eh)
+{
+  struct io_uring_sqe *sqe = get_sqe (u);
+
+  if (!sqe) {
+    /* no submission queue entry is free: retried by retry_cancel () once
+     * the queue was submitted, the handler stays ARMED (and is not freed)
+     * until then */
+    if (!(eh->flags & EVL_HF_CANCEL)) {
+      eh->flags |= EVL_HF_CANCEL;
+      u->ncancel++;
+    }
+    return;
+  }
+
+  if (eh->flags & EVL_HF_CANCEL) {
+    eh->flags &= ~EVL_HF_CANCEL;
+    u->ncancel--;
+  }
+
+  sqe->opcode    = IORING_OP_POLL_REMOVE;
+  sqe->fd        = -1;
+  sqe->addr      = (uintptr_t) eh | UD_POLL;
+  sqe->user_data = UD_IGNORE;
+}
+
+/* Submits cancellations that did not fit into the submission queue. */
+static void
+retry_cancel (struct evl_uring *u, struct evl_handler *list)
+{
+  struct evl_handler *eh;
+
+  chain_for_each (list, eh) {
+    if (!(eh->flags & EVL_HF_CANCEL))
+      continue;
+    if (eh->flags & EVL_HF_ARMED) {
+      disarm (u, eh);
+    } else {
+      /* completed meanwhile */
+      eh->flags &= ~EVL_HF_CANCEL;
+      u->ncancel--;
+    }
+  }
+}
+
+/**
+ * Creates the ring and maps its queues.
+ *
+ * @return 0 on success, -1 on error (io_uring is not available)
+ */
+int
+evl_uring_setup (struct evl_inst *inst)
+{
+  struct io_uring_params p;
+  struct evl_uring *u = calloc (1, sizeof (*u));
+  int error;
+
+  if (!u) {
+    errno = ENOMEM;
+    return -1;
+  }
+
+  memset (&p, 0, sizeof (p));
+  u->fd = sys_setup (inst->max_events * 2, &p);
+  if (u->fd < 0) {
+    error = errno;
+    free (u);
+    errno = error;
+    return -1;
+  }
+
+  u->sq_sz = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+  u->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (u->cq_sz > u->sq_sz)
+      u->sq_sz = u->cq_sz;
+    u->cq_sz = 0;
+  }
+
+  u->sq_ptr = mmap (NULL, u->sq_sz, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+  if (u->sq_ptr == MAP_FAILED)
+    goto err_sq;
+
+  if (u->cq_sz) {
+    u->cq_ptr = mmap (NULL, u->cq_sz, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    if (u->cq_ptr == MAP_FAILED)
+      goto err_cq;
+  } else {
+    u->cq_ptr = u->sq_ptr;
+  }
+
+  u->sqes_sz = p.sq_entries * sizeof (struct io_uring_sqe);
+  u->sqes = mmap (NULL, u->sqes_sz, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+  if (u->sqes == MAP_FAILED)
+    goto err_sqes;
+
+  u->sq_head    = u->sq_ptr + p.sq_off.head;
+  u->sq_tail    = u->sq_ptr + p.sq_off.tail;
+  u->sq_mask    = u->sq_ptr + p.sq_off.ring_mask;
+  u->sq_array   = u->sq_ptr + p.sq_off.array;
+  u->sq_entries = p.sq_entries;
+  u->tail       = *u->sq_tail;
+
+  u->cq_head = u->cq_ptr + p.cq_off.head;
+  u->cq_tail = u->cq_ptr + p.cq_off.tail;
+  u->cq_mask = u->cq_ptr + p.cq_off.ring_mask;
+  u->cqes    = u->cq_ptr + p.cq_off.cqes;
+
+  inst->uring = u;
+
+  return 0;
+
+err_sqes:
+  error = errno;
+  if (u->cq_sz)
+    munmap (u->cq_ptr, u->cq_sz);
+  errno = error;
+err_cq:
+  error = errno;
+  munmap (u->sq_ptr, u->sq_sz);
+  errno = error;
+err_sq:
+  error = errno;
+  perror ("io_uring mmap");
+  close (u->fd);
+  free (u);
+  errno = error;
+  return -1;
+}
+
+void
+evl_uring_destroy (struct evl_inst *inst)
+{
+  struct evl_uring *u = inst->uring;
+
+  munmap (u->sqes, u->sqes_sz);
+  if (u->cq_sz)
+    munmap (u->cq_ptr, u->cq_sz);
+  munmap (u->sq_ptr, u->sq_sz);
+  close (u->fd);
+  free (u);
+
+  inst->uring = NULL;
+}
+
+static void
+complete_poll (struct evl_inst *inst, struct evl_handler *eh, int res)
+{
+  uint32_t events;
+
+  eh->flags &= ~EVL_HF_ARMED;
+
+  if (!(eh->flags & EVL_HF_ALIVE))
+    return;
+
+  if (res == -ECANCELED) {
+    /* cancelled by evl_mod(): re-arm with the new events below */
+    events = 0;
+  } else if (res < 0) {
+    fprintf (stderr, "%s: poll on fd %d: %s\n", __func__, eh->fd, strerror (-res));
+    events = EPOLLERR;
+  } else {
+    events = (uint32_t) res & (eh->events | EPOLLERR | EPOLLHUP);
+  }
+
+  if (events)
+    (*eh->fn) (eh, events, eh->data);
+
+  if ((eh->flags & EVL_HF_ALIVE) && !(eh->flags & EVL_HF_ARMED) && eh->events)
+    arm (inst->uring, eh);
+}
+
+/**
+ * Runs one loop iteration: submits pending requests, waits for and
+ * dispatches a batch of completions.
+ *
+ * @return 0 on success, -1 on error
+ */
+int
+evl_uring_iter (struct evl_inst *inst)
+{
+  struct evl_uring *u = inst->uring;
+  unsigned head, tail;
+  int i, n = 0;
+
+  if (uring_enter (u, 1) < 0)
+    return -1;
+
+  /* copy completions out of the ring: callbacks may submit new requests */
+  head = *u->cq_head;
+  tail = __atomic_load_n (u->cq_tail, __ATOMIC_ACQUIRE);
+  while (head != tail && n < inst->max_events) {
+    struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+    inst->events[n].data.u64 = cqe->user_data;
+    inst->events[n].events   = (uint32_t) cqe->res;
+    n++;
+    head++;
+  }
+  __atomic_store_n (u->cq_head, head, __ATOMIC_RELEASE);
+
+  if (u->ncancel) {
+    retry_cancel (u, inst->list);
+    retry_cancel (u, inst->cl);
+  }
+
+  if (inst->loop_start) {
+    (*inst->loop_start) (inst);
+  }
+
+  for (i = 0; i < n; ++i) {
+    uint64_t ud = inst->events[i].data.u64;
+    int res = (int) inst->events[i].events;
+
+    switch (UD_TAG (ud)) {
+    case UD_POLL:
+      complete_poll (inst, UD_PTR (ud), res);
+      break;
+    case UD_WRITE: {
+      struct write_req *req = UD_PTR (ud);
+      (*req->fn) (inst, res, req->data);
+      free (req);
+      break;
+    }
+    default:
+      break;
+    }
+  }
+
+  if (inst->loop_end) {
+    (*inst->loop_end) (inst);
+  }
+
+  return 0;
+}
+
+void
+evl_uring_mod (struct evl_inst *inst, struct evl_handler *eh, uint32_t events)
+{
+  eh->events = events;
+
+  if (eh->flags & EVL_HF_ARMED)
+    disarm (inst->uring, eh);
+  else if (events)
+    arm (inst->uring, eh);
+}
+
+/**
+ * Cancels the poll request of the handler. The handler memory must not be
+ * freed until its completion arrives (EVL_HF_ARMED is cleared).
+ */
+void
+evl_uring_del (struct evl_inst *inst, struct evl_handler *eh)
+{
+  eh->events = 0;
+
+  if (eh->flags & EVL_HF_ARMED)
+    disarm (inst->uring, eh);
+}
+
+int
+evl_uring_add (struct evl_inst *inst, struct evl_handler *eh)
+{
+  if (!eh->events)
+    return 0;
+
+  return arm (inst->uring, eh);
+}
+
+int
+evl_uring_write (struct evl_inst *inst,
+                 int fd,
+                 const void *buf,
+                 size_t count,
+                 evl_wcb_fn fun,
+                 void *user_data)
+{
+  struct evl_uring *u = inst->uring;
+  struct write_req *req = malloc (sizeof (*req));
+
+  if (!req) {
+    errno = ENOMEM;
+    return -1;
+  }
+
+  struct io_uring_sqe *sqe = get_sqe (u);
+  if (!sqe) {
+    free (req);
+    errno = EBUSY;
+    return -1;
+  }
+
+  req->fn   = fun;
+  req->data = user_data;
+
+  sqe->opcode    = IORING_OP_WRITE;
+  sqe->fd        = fd;
+  sqe->addr      = (uintptr_t) buf;
+  sqe->len       = count;
+  sqe->off       = (uint64_t) -1; /* current position */
+  sqe->user_data = (uintptr_t) req | UD_WRITE;
+
+  return 0;
+}
+
+#endif /* EVL_URING */
@@ -0,0 +1,38 @@
+#ifndef _EVL_URING_H
+#define _EVL_URING_H
+
+/* io_uring engine internals used by evl.c */
+
+#include "evl.h"
+
+#ifdef EVL_URING
+
+extern int
+evl_uring_setup (struct evl_inst *inst);
+
+extern void
+evl_uring_destroy (struct evl_inst *inst);
+
+extern int
+evl_uring_iter (struct evl_inst *inst);
+
+extern int
+evl_uring_add (struct evl_inst *inst, struct evl_handler *eh);
+
+extern void
+evl_uring_mod (struct evl_inst *inst, struct evl_handler *eh, uint32_t events);
+
+extern void
+evl_uring_del (struct evl_inst *inst, struct evl_handler *eh);
+
+extern int
+evl_uring_write (struct evl_inst *inst,
+                 int fd,
+                 const void *buf,
+                 size_t count,
+                 evl_wcb_fn fun,
+                 void *user_data);
+
+#endif /* EVL_URING */
+
+#endif /* _EVL_URING_H */
@@ -0,0 +1,526 @@
+/**
+ * @file handover.c
+ *
+ * @brief Handover of the inotify instance to a new port (zero-loss upgrade).
+ *
+ * On the handover command the running port listens on a Unix socket.  A new
+ * port started with -H connects to it and receives the inotify descriptor
+ * (SCM_RIGHTS) together with the watch table and the event sequence number.
+ * Only a process of the same user started by our parent (or by us) is
+ * accepted.  The old port stops reading inotify at that moment, so events it
+ * has not read yet stay in the kernel queue and are read by the new port;
+ * events already read are written to the owner before the old port exits.
+ * The state is sent without blocking the loop, on failure the old port
+ * resumes and waits for another connection.  The handover command with an
+ * empty path cancels waiting (the new port failed to start).
+ *
+ * Socket paths starting with `@' are in the abstract namespace.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#define _GNU_SOURCE /* for TEMP_FAILURE_RETRY */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "budget.h"
+#include "control.h"
+#include "handover.h"
+#include "log.h"
+#include "watch.h"
+
+#define HANDOVER_MAGIC   0x65696e68 /* "einh" */
+#define HANDOVER_VERSION 1
+
+/* sent with the descriptor */
+struct hdr {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t seq;
+    int64_t  credit;
+    uint32_t count;
+    uint32_t size;  /* bytes of records following the header */
+};
+
+/* watch record, followed by the path (with terminating zero) */
+struct rec {
+    int32_t  wd;
+    uint32_t mask;
+    uint32_t flags;
+    int32_t  prio;
+    uint32_t rate;
+    uint32_t burst;
+    uint32_t names;
+    uint32_t evictable;
+    uint32_t ttl;
+    uint32_t path_len;
+};
+
+struct tbl {
+    char   *data;
+    size_t len;
+    size_t cap;
+    uint32_t count;
+};
+
+static struct evl_handler *eh = NULL;
+static char *sock_path = NULL;
+/* connection of the new port while the state is sent: header and records,
+ * bytes sent */
+static struct evl_handler *xeh = NULL;
+static struct tbl xfer = { NULL, 0, 0, 0 };
+static size_t xoff = 0;
+/* table received by the new port until handover_restore() */
+static struct hdr rhdr;
+static char *rdata = NULL;
+
+/* Fills socket address, returns its length or -1. */
+static socklen_t
+sock_addr (const char *path, struct sockaddr_un *sa)
+{
+    size_t len = strlen (path);
+
+    memset (sa, 0, sizeof (*sa));
+    sa->sun_family = AF_UNIX;
+    if (len == 0 || len >= sizeof (sa->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    memcpy (sa->sun_path, path, len);
+    if (path[0] == '@') {
+        sa->sun_path[0] = 0;
+        return offsetof (struct sockaddr_un, sun_path) + len;
+    }
+
+    return sizeof (*sa);
+}
+
+static void
+tbl_reserve (struct tbl *t, size_t sz)
+{
+    if (t->len + sz > t->cap) {
+        t->cap = t->cap ? t->cap * 2 : 65536;
+        while (t->cap < t->len + sz)
+            t->cap *= 2;
+        t->data = realloc (t->data, t->cap);
+        assert (t->data != NULL);
+    }
+}
+
+static void
+tbl_add (struct watch *w, void *arg)
+{
+    struct tbl *t = arg;
+    struct watch_opts opts;
+    const struct sub *s = watch_sub (w, control_owner ());
+
+    if (s == NULL)
+        return;
+
+    watch_get_opts (s, &opts);
+
+    size_t plen = strlen (w->path) + 1;
+    size_t sz = sizeof (struct rec) + plen;
+    tbl_reserve (t, sz);
+
+    struct rec r = {
+        .wd        = w->wd,
+        .mask      = s->mask,
+        .flags     = opts.flags,
+        .prio      = opts.prio,
+        .rate      = opts.rate,
+        .burst     = opts.burst,
+        .names     = opts.names,
+        .evictable = opts.evictable,
+        .ttl       = opts.ttl,
+        .path_len  = plen,
+    };
+    memcpy (t->data + t->len, &r, sizeof (r));
+    memcpy (t->data + t->len + sizeof (r), w->path, plen);
+    t->len += sz;
+    t->count++;
+}
+
+static int
+read_all (int fd, char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = TEMP_FAILURE_RETRY (read (fd, buf, len));
+        if (n <= 0) {
+            if (n == 0)
+                errno = EPIPE;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/* Collects the header and the watch table into `xfer'. */
+static void
+pack_state (void)
+{
+    long credit;
+
+    xfer.len = xfer.count = 0;
+    tbl_reserve (&xfer, sizeof (struct hdr));
+    xfer.len = sizeof (struct hdr);
+    watch_for_each (&tbl_add, &xfer);
+
+    struct hdr h = {
+        .magic   = HANDOVER_MAGIC,
+        .version = HANDOVER_VERSION,
+        .count   = xfer.count,
+        .size    = xfer.len - sizeof (h),
+    };
+    control_get_state (&h.seq, &credit);
+    h.credit = credit;
+    memcpy (xfer.data, &h, sizeof (h));
+    xoff = 0;
+
+    DEBUG ("%s: %u watches, seq %lu", __func__, xfer.count, (unsigned long) h.seq);
+}
+
+/**
+ * Sends the rest of `xfer', the inotify descriptor goes with the first byte.
+ *
+ * @return 1 when all is sent, 0 if the socket is full, -1 on error
+ */
+static int
+send_state (int fd)
+{
+    while (xoff < xfer.len) {
+        ssize_t n;
+
+        if (xoff == 0) {
+            int ifd = watch_fd ();
+            char cbuf[CMSG_SPACE (sizeof (ifd))];
+            struct iovec iov = { .iov_base = xfer.data, .iov_len = xfer.len };
+            struct msghdr msg = {
+                .msg_iov        = &iov,
+                .msg_iovlen     = 1,
+                .msg_control    = cbuf,
+                .msg_controllen = sizeof (cbuf),
+            };
+            struct cmsghdr *cm = CMSG_FIRSTHDR (&msg);
+            cm->cmsg_level = SOL_SOCKET;
+            cm->cmsg_type  = SCM_RIGHTS;
+            cm->cmsg_len   = CMSG_LEN (sizeof (ifd));
+            memcpy (CMSG_DATA (cm), &ifd, sizeof (ifd));
+
+            n = TEMP_FAILURE_RETRY (sendmsg (fd, &msg, MSG_NOSIGNAL));
+        } else {
+            n = TEMP_FAILURE_RETRY (send (fd, xfer.data + xoff, xfer.len - xoff,
+                                          MSG_NOSIGNAL));
+        }
+
+        if (n == -1)
+            return errno == EAGAIN ? 0 : -1;
+        xoff += n;
+    }
+
+    return 1;
+}
+
+/* Returns parent of the process `pid' or -1. */
+static pid_t
+parent_of (pid_t pid)
+{
+    char path[64], buf[512];
+    int ppid;
+
+    snprintf (path, sizeof (path), "/proc/%d/stat", (int) pid);
+    int fd = open (path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+
+    ssize_t n = TEMP_FAILURE_RETRY (read (fd, buf, sizeof (buf) - 1));
+    TEMP_FAILURE_RETRY (close (fd));
+    if (n <= 0)
+        return -1;
+    buf[n] = 0;
+
+    /* "pid (comm) state ppid ...", the command may contain anything */
+    const char *p = strrchr (buf, ')');
+    if (p == NULL || sscanf (p + 1, " %*c %d", &ppid) != 1)
+        return -1;
+
+    return ppid;
+}
+
+/* Checks that the peer is run by our user and started by our parent (the
+ * new port of the same VM) or by us. */
+static int
+peer_allowed (int fd)
+{
+    struct ucred cr;
+    socklen_t len = sizeof (cr);
+
+    if (getsockopt (fd, SOL_SOCKET, SO_PEERCRED, &cr, &len) == -1) {
+        WARNING ("getsockopt (SO_PEERCRED): %s", strerror (errno));
+        return 0;
+    }
+
+    pid_t ppid = parent_of (cr.pid);
+    if (cr.uid != geteuid () || (ppid != getppid () && ppid != getpid ())) {
+        WARNING ("%s: pid %d (uid %d) is not a port of this owner", __func__,
+                 (int) cr.pid, (int) cr.uid);
+        return 0;
+    }
+
+    return 1;
+}
+
+static void
+listen_stop (struct evl_inst *loop)
+{
+    evl_del (loop, eh);
+    TEMP_FAILURE_RETRY (close (eh->fd));
+    eh = NULL;
+    if (sock_path[0] != '@')
+        unlink (sock_path);
+    free (sock_path);
+    sock_path = NULL;
+}
+
+static void
+xfer_stop (struct evl_inst *loop)
+{
+    evl_del (loop, xeh);
+    TEMP_FAILURE_RETRY (close (xeh->fd));
+    xeh = NULL;
+    free (xfer.data);
+    xfer.data = NULL;
+    xfer.cap  = 0;
+}
+
+static void
+xfer_handler (struct evl_handler *h, uint32_t _events, void *arg)
+{
+    struct evl_inst *loop = arg;
+
+    int rc = send_state (h->fd);
+    if (rc == 0)
+        return;
+
+    xfer_stop (loop);
+
+    if (rc == -1) {
+        /* reading resumes in control_flush() */
+        ERR ("%s: %s", __func__, strerror (errno));
+        evl_mod (loop, eh, EPOLLIN);
+        return;
+    }
+
+    /* the new port owns the instance now: no more reads or removals here */
+    budget_destroy (loop);
+    listen_stop (loop);
+    control_shutdown ();
+}
+
+static void
+handover_handler (struct evl_handler *eh, uint32_t _events, void *arg)
+{
+    struct evl_inst *loop = arg;
+
+    int fd = accept4 (eh->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == -1) {
+        if (errno != EAGAIN && errno != EINTR)
+            WARNING ("accept: %s", strerror (errno));
+        return;
+    }
+
+    if (!peer_allowed (fd)) {
+        TEMP_FAILURE_RETRY (close (fd));
+        return;
+    }
+
+    /* the table must match the kernel queue left to the new port: stop
+     * reading before anything else is read (see control_flush()) */
+    watch_pause (1);
+    pack_state ();
+
+    evl_mod (loop, eh, 0);
+    xeh = evl_add (loop, fd, EPOLLOUT, &xfer_handler, loop);
+    assert (xeh != NULL);
+}
+
+/**
+ * Stops waiting for a new port (it failed to start) and aborts a transfer in
+ * progress.  Reading inotify resumes in control_flush().
+ */
+void
+handover_cancel (struct evl_inst *loop)
+{
+    if (xeh != NULL)
+        xfer_stop (loop);
+    if (eh != NULL)
+        listen_stop (loop);
+}
+
+/* Returns non-zero from the handover command until the new port took over. */
+int
+handover_pending (void)
+{
+    return eh != NULL;
+}
+
+/* Returns non-zero while the state is being sent to a new port. */
+int
+handover_busy (void)
+{
+    return xeh != NULL;
+}
+
+/**
+ * Waits for a new port to connect to @a path and hands the inotify instance
+ * over to it.
+ *
+ * @return 0 on success, -1 with errno set on error
+ */
+int
+handover_listen (struct evl_inst *loop, const char *path)
+{
+    struct sockaddr_un sa;
+
+    if (eh != NULL) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    socklen_t len = sock_addr (path, &sa);
+    if (len == (socklen_t) -1)
+        return -1;
+
+    int fd = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return -1;
+
+    if (bind (fd, (struct sockaddr *) &sa, len) == -1 || listen (fd, 1) == -1) {
+        int tmp = errno;
+        TEMP_FAILURE_RETRY (close (fd));
+        errno = tmp;
+        return -1;
+    }
+
+    eh = evl_add (loop, fd, EPOLLIN, &handover_handler, loop);
+    assert (eh != NULL);
+    sock_path = strdup (path);
+    assert (sock_path != NULL);
+
+    return 0;
+}
+
+/**
+ * Connects to the old port listening on @a path and receives the inotify
+ * descriptor and the watch table (restored by handover_restore()).
+ *
+ * @return inotify descriptor or -1 on error
+ */
+int
+handover_recv (const char *path)
+{
+    struct sockaddr_un sa;
+    int ifd = -1;
+
+    socklen_t len = sock_addr (path, &sa);
+    if (len == (socklen_t) -1) {
+        ERR ("%s: invalid path %s", __func__, path);
+        return -1;
+    }
+
+    int fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1 || connect (fd, (struct sockaddr *) &sa, len) == -1) {
+        ERR ("connect (%s): %s", path, strerror (errno));
+        goto out;
+    }
+
+    char cbuf[CMSG_SPACE (sizeof (ifd))];
+    struct iovec iov = { .iov_base = &rhdr, .iov_len = sizeof (rhdr) };
+    struct msghdr msg = {
+        .msg_iov        = &iov,
+        .msg_iovlen     = 1,
+        .msg_control    = cbuf,
+        .msg_controllen = sizeof (cbuf),
+    };
+
+    ssize_t n = TEMP_FAILURE_RETRY (recvmsg (fd, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC));
+    struct cmsghdr *cm = n > 0 ? CMSG_FIRSTHDR (&msg) : NULL;
+    if (cm != NULL && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS)
+        memcpy (&ifd, CMSG_DATA (cm), sizeof (ifd));
+
+    if (n != sizeof (rhdr) || ifd == -1
+        || rhdr.magic != HANDOVER_MAGIC || rhdr.version != HANDOVER_VERSION) {
+        ERR ("%s: invalid handover from %s", __func__, path);
+        goto fail;
+    }
+
+    rdata = malloc (rhdr.size ? rhdr.size : 1);
+    assert (rdata != NULL);
+    if (read_all (fd, rdata, rhdr.size) == -1) {
+        ERR ("%s: read: %s", __func__, strerror (errno));
+        goto fail;
+    }
+
+    goto out;
+
+fail:
+    if (ifd != -1)
+        TEMP_FAILURE_RETRY (close (ifd));
+    ifd = -1;
+    free (rdata);
+    rdata = NULL;
+out:
+    if (fd != -1)
+        TEMP_FAILURE_RETRY (close (fd));
+    return ifd;
+}
+
+/* Records the received watches for the owner. */
+void
+handover_restore (void)
+{
+    size_t off = 0;
+
+    assert (rdata != NULL);
+
+    for (uint32_t i = 0; i < rhdr.count; i++) {
+        struct rec r;
+
+        assert (off + sizeof (r) <= rhdr.size);
+        memcpy (&r, rdata + off, sizeof (r));
+        off += sizeof (r);
+        assert (off + r.path_len <= rhdr.size && r.path_len > 0);
+
+        struct watch_opts opts = {
+            .flags     = r.flags,
+            .prio      = r.prio,
+            .rate      = r.rate,
+            .burst     = r.burst,
+            .names     = r.names,
+            .evictable = r.evictable,
+            .ttl       = r.ttl,
+        };
+        watch_restore (r.wd, rdata + off, r.mask, &opts, control_owner ());
+        off += r.path_len;
+    }
+
+    control_set_state (rhdr.seq, rhdr.credit);
+    DEBUG ("%s: %u watches, seq %lu", __func__, rhdr.count, (unsigned long) rhdr.seq);
+
+    free (rdata);
+    rdata = NULL;
+}
@@ -0,0 +1,24 @@
+#ifndef _HANDOVER_H
+#define _HANDOVER_H
+
+#include "evl.h"
+
+extern int
+handover_listen (struct evl_inst *loop, const char *path);
+
+extern void
+handover_cancel (struct evl_inst *loop);
+
+extern int
+handover_pending (void);
+
+extern int
+handover_busy (void);
+
+extern int
+handover_recv (const char *path);
+
+extern void
+handover_restore (void);
+
+#endif /* _HANDOVER_H */
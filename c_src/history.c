@@ -0,0 +1,159 @@
+/**
+ * @file history.c
+ *
+ * @brief Bounded history of sent events for replay.
+ *
+ * Encoded events are kept in a byte ring together with their sequence
+ * numbers, watch descriptors and masks (for filtering on replay); when the
+ * ring is full the oldest events are dropped.  Records never wrap around
+ * the end of the buffer: if a record does not fit at the end, writing
+ * continues at the beginning and the rest is left unused.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "history.h"
+
+/* default ring size (bytes) */
+#define HISTORY_SZ (1 << 20)
+
+struct rec {
+    uint64_t seq;
+    uint32_t len;
+    int      wd;
+    uint32_t mask;
+    char     data[];
+};
+
+#define REC_SZ(len) ((sizeof (struct rec) + (len) + 7) & ~(size_t) 7)
+
+static char *buf = NULL;
+static size_t cap = 0;
+/* oldest record, next record to write and end of data before wrap */
+static size_t head = 0;
+static size_t tail = 0;
+static size_t end = 0;
+/* data is [head, end) + [0, tail) */
+static int wrapped = 0;
+static unsigned long count = 0;
+
+static void
+drop_oldest (void)
+{
+    struct rec *r = (struct rec *) (buf + head);
+
+    head += REC_SZ (r->len);
+    count--;
+
+    if (wrapped && head == end) {
+        head    = 0;
+        wrapped = 0;
+    }
+    if (count == 0)
+        head = tail = end = wrapped = 0;
+}
+
+/**
+ * Sets size of the ring, 0 disables the history.  Recorded events are
+ * discarded.
+ */
+int
+history_set_size (size_t sz)
+{
+    free (buf);
+    buf = NULL;
+    cap = 0;
+    head = tail = end = wrapped = 0;
+    count = 0;
+
+    if (sz == 0)
+        return 0;
+
+    cap = sz & ~(size_t) 7;
+    buf = malloc (cap);
+    assert (buf != NULL);
+
+    return 0;
+}
+
+int
+history_init (void)
+{
+    return history_set_size (HISTORY_SZ);
+}
+
+void
+history_add (uint64_t seq, int wd, uint32_t mask, const void *data, size_t len)
+{
+    size_t sz = REC_SZ (len);
+
+    if (sz > cap)
+        return;
+
+    for (;;) {
+        if (!wrapped) {
+            if (tail + sz <= cap)
+                break;
+            /* continue at the beginning */
+            end     = tail;
+            tail    = 0;
+            wrapped = 1;
+            if (count == 0) {
+                head = end = wrapped = 0;
+                break;
+            }
+        }
+
+        if (tail + sz <= head)
+            break;
+        drop_oldest ();
+    }
+
+    struct rec *r = (struct rec *) (buf + tail);
+    r->seq  = seq;
+    r->len  = len;
+    r->wd   = wd;
+    r->mask = mask;
+    memcpy (r->data, data, len);
+    tail += sz;
+    count++;
+}
+
+/* Returns sequence number of the oldest recorded event (0 if empty). */
+uint64_t
+history_oldest (void)
+{
+    return count ? ((struct rec *) (buf + head))->seq : 0;
+}
+
+unsigned long
+history_count (void)
+{
+    return count;
+}
+
+/**
+ * Calls @a fn for every recorded event with sequence number above @a seq
+ * (in order).
+ */
+void
+history_replay (uint64_t seq, history_fn *fn, void *arg)
+{
+    size_t off = head;
+    unsigned long n = count;
+
+    while (n-- > 0) {
+        if (wrapped && off == end)
+            off = 0;
+
+        struct rec *r = (struct rec *) (buf + off);
+        if (r->seq > seq)
+            fn (r->wd, r->mask, r->data, r->len, arg);
+        off += REC_SZ (r->len);
+    }
+}
@@ -0,0 +1,29 @@
+#ifndef _HISTORY_H
+#define _HISTORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* replay callback prototype */
+typedef void (history_fn) (int wd, uint32_t mask, const void *data, size_t len,
+                           void *arg);
+
+extern int
+history_init (void);
+
+extern int
+history_set_size (size_t sz);
+
+extern void
+history_add (uint64_t seq, int wd, uint32_t mask, const void *data, size_t len);
+
+extern uint64_t
+history_oldest (void);
+
+extern unsigned long
+history_count (void);
+
+extern void
+history_replay (uint64_t seq, history_fn *fn, void *arg);
+
+#endif /* _HISTORY_H */
@@ -12,3 +12,19 @@ log_init (int daemon, int debug)
   openlog (NULL, LOG_CONS | (daemon ? 0 : LOG_PERROR), LOG_DAEMON);
   setlogmask (LOG_UPTO (debug ? LOG_DEBUG : LOG_INFO));
 }
+
+/**
+ * Sets the most verbose level to log (LOG_EMERG .. LOG_DEBUG).
+ *
+ * @return 0 on success, -1 if the level is invalid
+ */
+int
+log_set_level (int level)
+{
+  if (level < LOG_EMERG || level > LOG_DEBUG)
+    return -1;
+
+  setlogmask (LOG_UPTO (level));
+
+  return 0;
+}
@@ -6,6 +6,9 @@
 extern void
 log_init (int daemon, int debug);
 
+extern int
+log_set_level (int level);
+
 #define LOG(level, format, arg...) \
   syslog (level, "%s:%d: " format "\r", __FILE__, __LINE__, ##arg)
 
@@ -16,6 +19,11 @@ log_init (int daemon, int debug);
 #define WARNING(format, arg...) LOG (LOG_WARNING, format, ##arg)
 #define NOTICE(format, arg...)  LOG (LOG_NOTICE, format, ##arg)
 #define INFO(format, arg...)    LOG (LOG_INFO, format, ##arg)
+/* DEBUG messages are compiled in only if LOG_WITH_DEBUG is defined */
+#ifdef LOG_WITH_DEBUG
 #define DEBUG(format, arg...)   LOG (LOG_DEBUG, format, ##arg)
+#else
+#define DEBUG(format, arg...)   do { if (0) LOG (LOG_DEBUG, format, ##arg); } while (0)
+#endif /* LOG_WITH_DEBUG */
 
 #endif /* __LOG_H__ */
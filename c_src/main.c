@@ -1,27 +1,193 @@
 #include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+#include "budget.h"
+#include "checkpoint.h"
 #include "control.h"
+#include "crawl.h"
 #include "evl.h"
+#include "handover.h"
 #include "log.h"
+#include "poll.h"
+#include "rate.h"
 #include "watch.h"
 
 #define MAX_EVENTS 10
 
+static void
+usage (const char *name)
+{
+    ERR ("usage: %s [-u] [-d socket | -H socket] [-k checkpoint] [-b batch] [-r rbuf] [-s sbuf] [-w write_max]"
+         " [-c coalesce] [-l log_level] [-m watch_budget] [-h history]"
+         " [-a active]", name);
+    exit (EXIT_FAILURE);
+}
+
+/* command line options mapped to runtime tunables */
+static const struct {
+    int opt;
+    int key;
+} tunables[] = {
+    { 'b', CONTROL_OPT_BATCH },
+    { 'r', CONTROL_OPT_RBUF },
+    { 's', CONTROL_OPT_SBUF },
+    { 'w', CONTROL_OPT_WRITE_MAX },
+    { 'c', CONTROL_OPT_COALESCE },
+    { 'l', CONTROL_OPT_LOG_LEVEL },
+    { 'm', CONTROL_OPT_WATCH_BUDGET },
+    { 'h', CONTROL_OPT_HISTORY },
+    { 'a', CONTROL_OPT_ACTIVE },
+};
+
+#define NTUNABLES (sizeof (tunables) / sizeof (tunables[0]))
+
+/* Creates listening Unix domain socket for daemon mode (a stale socket
+ * file of a previous instance is replaced). */
+static int
+listen_unix (const char *path)
+{
+    struct sockaddr_un sa = { .sun_family = AF_UNIX };
+
+    if (strlen (path) >= sizeof (sa.sun_path)) {
+        ERR ("socket path too long: %s", path);
+        return -1;
+    }
+    strcpy (sa.sun_path, path);
+
+    int fd = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        ERR ("socket: %s", strerror (errno));
+        return -1;
+    }
+
+    unlink (path);
+    if (bind (fd, (struct sockaddr *) &sa, sizeof (sa)) == -1
+        || listen (fd, SOMAXCONN) == -1) {
+        ERR ("bind (%s): %s", path, strerror (errno));
+        close (fd);
+        return -1;
+    }
+
+    return fd;
+}
+
 int
 main (int argc, char *argv[])
 {
-    struct evl_inst *loop;
+    struct evl_inst *loop = NULL;
+    unsigned long vals[NTUNABLES];
+    int set[NTUNABLES] = { 0 };
+    const char *sock = NULL, *from = NULL, *ckpt = NULL;
+    int opt, uring = 0, lfd = -1, ifd = -1;
+
+    log_init (0, 0);
 
-    log_init (0, 1);
+    while ((opt = getopt (argc, argv, "ud:H:k:b:r:s:w:c:l:m:h:a:")) != -1) {
+        if (opt == 'u') { /* use io_uring engine */
+            uring = 1;
+            continue;
+        }
+        if (opt == 'd') { /* serve clients on a Unix domain socket */
+            sock = optarg;
+            continue;
+        }
+        if (opt == 'H') { /* take over inotify from the port listening there */
+            from = optarg;
+            continue;
+        }
+        if (opt == 'k') { /* checkpoint the watch set to a file */
+            ckpt = optarg;
+            continue;
+        }
 
-    loop = evl_init (MAX_EVENTS, NULL, NULL);
+        unsigned int i;
+        for (i = 0; i < NTUNABLES && tunables[i].opt != opt; i++)
+            ;
+        if (i == NTUNABLES)
+            usage (argv[0]);
+
+        char *end;
+        vals[i] = strtoul (optarg, &end, 0);
+        if (*optarg == 0 || *end != 0)
+            usage (argv[0]);
+        set[i] = 1;
+    }
+
+    /* watches of daemon clients are not checkpointed (no owner) */
+    if (sock != NULL && (from != NULL || ckpt != NULL))
+        usage (argv[0]);
+
+    if (from != NULL) {
+        ifd = handover_recv (from);
+        if (ifd == -1)
+            exit (EXIT_FAILURE);
+    }
+
+    if (sock != NULL) {
+        lfd = listen_unix (sock);
+        if (lfd == -1)
+            exit (EXIT_FAILURE);
+        /* write errors of gone clients are handled */
+        signal (SIGPIPE, SIG_IGN);
+    }
+
+#ifdef EVL_URING
+    if (uring) {
+        loop = evl_init_uring (MAX_EVENTS, NULL, &control_flush);
+        if (loop == NULL)
+            WARNING ("io_uring is not available, falling back to epoll");
+    }
+#else
+    if (uring)
+        WARNING ("io_uring engine is not built in, using epoll");
+#endif /* EVL_URING */
+
+    if (loop == NULL)
+        loop = evl_init (MAX_EVENTS, NULL, &control_flush);
     assert (loop);
 
-    int rc = watch_init (loop);
+    int rc = watch_init (loop, ifd);
     assert (rc == 0);
-    control_init (loop);
+    rc = crawl_init (loop);
+    assert (rc == 0);
+    rc = rate_init (loop);
+    assert (rc == 0);
+    rc = budget_init (loop);
+    assert (rc == 0);
+    rc = poll_init (loop);
+    assert (rc == 0);
+    control_init (loop, lfd);
+    if (ckpt != NULL) {
+        rc = checkpoint_init (loop, ckpt);
+        if (rc == -1) {
+            ERR ("can not checkpoint to %s", ckpt);
+            exit (EXIT_FAILURE);
+        }
+    }
+
+    for (unsigned int i = 0; i < NTUNABLES; i++) {
+        if (set[i] && control_set_opt (loop, tunables[i].key, vals[i]) == -1) {
+            ERR ("invalid value for -%c: %lu", tunables[i].opt, vals[i]);
+            exit (EXIT_FAILURE);
+        }
+    }
+
+    /* after the tunables: credits of the old port are kept */
+    if (from != NULL)
+        handover_restore ();
+    /* re-add the checkpointed watches unless taken over */
+    if (ckpt != NULL)
+        checkpoint_restore (from == NULL);
+    /* the restore results and the passive message with -a 0 are written
+     * without waiting for the first event */
+    control_flush (loop);
 
     evl_start (loop);
 
@@ -0,0 +1,451 @@
+/**
+ * @file out.c
+ *
+ * @brief Buffered, prioritized output of {packet, 2} framed messages.
+ *
+ * Messages are queued per priority class and written from out_flush(),
+ * normally called by the loop_end hook.  Every write takes whole messages
+ * from the queues in class order (replies first, then replayed events and
+ * high, normal and low priority events) up to `write_max' bytes, so when the
+ * output is backlogged later high priority messages still overtake queued
+ * low priority ones.
+ * The descriptor is non-blocking; on EAGAIN the output waits for EPOLLOUT.
+ *
+ * All classes but replies are subject to credits granted by the owner: every
+ * message taken from them consumes one credit, and when the last credit is
+ * used the passive message is written after it.  Without credits events stay
+ * queued.
+ *
+ * When the reader is gone or a write fails, the error callback is called and
+ * nothing more is written; the owner of the output frees it.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "out.h"
+
+/* default maximum number of bytes taken from the queues for a single write */
+#define WRITE_MAX 65536
+/* default low priority queue size above which duplicates are coalesced */
+#define COALESCE_THRESHOLD 65536
+
+struct buf {
+    char   *data;
+    size_t head;
+    size_t len;
+    size_t cap;
+};
+
+struct out {
+    struct evl_inst    *loop;
+    struct evl_handler *eh;
+    int                fd;
+    /* queued messages per class */
+    struct buf         queue[OUT_NCLASSES];
+    /* offset of the last message in the low priority queue and the length
+     * of its part compared for coalescing */
+    size_t             last_low;
+    uint16_t           last_key;
+    /* data being written */
+    struct buf         wr;
+    int                busy;
+    /* out_flush() is running */
+    int                flushing;
+    /* waiting for EPOLLOUT */
+    int                blocked;
+    /* the descriptor is unusable */
+    int                failed;
+    out_error_fn       *on_error;
+    void               *arg;
+    unsigned long      coalesced;
+    unsigned long      dropped;
+    /* credits for event messages (-1 - unlimited) and the message
+     * written when they run out */
+    long               credit;
+    char               *passive;
+    uint16_t           passive_len;
+    /* tunables */
+    size_t             write_max;
+    size_t             coalesce;
+};
+
+static void
+buf_reserve (struct buf *b, size_t count)
+{
+    if (b->head > 0 && b->head >= b->len / 2) {
+        /* compact consumed space first */
+        memmove (b->data, b->data + b->head, b->len - b->head);
+        b->len -= b->head;
+        b->head = 0;
+    }
+
+    if (b->len + count <= b->cap)
+        return;
+
+    size_t cap = b->cap ? b->cap : 4096;
+    while (cap < b->len + count)
+        cap *= 2;
+
+    b->data = realloc (b->data, cap);
+    assert (b->data != NULL);
+    b->cap = cap;
+}
+
+static void
+write_next (struct out *o);
+
+static void
+fail (struct out *o, int err)
+{
+    o->failed = 1;
+    o->busy   = 0;
+    o->on_error (o->arg, err);
+}
+
+static void
+out_handler (struct evl_handler *eh, uint32_t events, void *arg)
+{
+    struct out *o = arg;
+
+    o->blocked = 0;
+    evl_mod (o->loop, o->eh, 0);
+
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        /* the reader is gone */
+        fail (o, 0);
+        return;
+    }
+
+    write_next (o);
+}
+
+/**
+ * Creates output for the descriptor @a fd, @a on_error is called with errno
+ * (0 if the reader is gone) when it can no longer be written.
+ */
+struct out *
+out_new (struct evl_inst *loop, int fd, out_error_fn *on_error, void *arg)
+{
+    struct out *o = calloc (1, sizeof (*o));
+    assert (o != NULL);
+
+    o->loop      = loop;
+    o->fd        = fd;
+    o->on_error  = on_error;
+    o->arg       = arg;
+    o->last_low  = (size_t) -1;
+    o->credit    = -1;
+    o->write_max = WRITE_MAX;
+    o->coalesce  = COALESCE_THRESHOLD;
+
+    int fl = fcntl (fd, F_GETFL);
+    if (fl == -1 || fcntl (fd, F_SETFL, fl | O_NONBLOCK) == -1)
+        WARNING ("fcntl (O_NONBLOCK): %s", strerror (errno));
+
+    o->eh = evl_add (loop, fd, 0, &out_handler, o);
+    assert (o->eh != NULL);
+
+    return o;
+}
+
+void
+out_free (struct out *o)
+{
+    evl_del (o->loop, o->eh);
+    for (int i = 0; i < OUT_NCLASSES; i++)
+        free (o->queue[i].data);
+    free (o->wr.data);
+    free (o->passive);
+    free (o);
+}
+
+/* Checks if the first `key' bytes of the message are the same as those of
+ * the last queued low priority one. */
+static int
+is_duplicate (struct out *o, const void *buf, uint16_t key)
+{
+    struct buf *q = &o->queue[OUT_LOW];
+
+    if (o->last_low == (size_t) -1
+        || o->last_low < q->head
+        || q->len - q->head < o->coalesce)
+        return 0;
+
+    return o->last_key == key
+        && memcmp (q->data + o->last_low + sizeof (uint16_t), buf, key) == 0;
+}
+
+/**
+ * Queues framed message in the given class.
+ */
+void
+out_put (struct out *o, int cls, const void *buf, uint16_t count)
+{
+    out_put_key (o, cls, buf, count, count);
+}
+
+/**
+ * Queues framed message in the given class.  A low priority message is
+ * coalesced with the last queued one if their first @a key bytes are the
+ * same (the rest, like the sequence number of an event, may differ).
+ */
+void
+out_put_key (struct out *o, int cls, const void *buf, uint16_t count, uint16_t key)
+{
+    assert (cls >= 0 && cls < OUT_NCLASSES);
+    assert (key <= count);
+
+    if (cls == OUT_LOW && is_duplicate (o, buf, key)) {
+        o->coalesced++;
+        return;
+    }
+
+    struct buf *q = &o->queue[cls];
+    uint16_t len = htobe16 (count);
+
+    buf_reserve (q, sizeof (len) + count);
+    if (cls == OUT_LOW) {
+        o->last_low = q->len;
+        o->last_key = key;
+    }
+    memcpy (q->data + q->len, &len, sizeof (len));
+    memcpy (q->data + q->len + sizeof (len), buf, count);
+    q->len += sizeof (len) + count;
+}
+
+/* Moves whole messages from the queues to the write buffer. */
+static void
+fill (struct out *o)
+{
+    struct buf *wr = &o->wr;
+
+    wr->head = wr->len = 0;
+
+    for (int i = 0; i < OUT_NCLASSES; i++) {
+        struct buf *q = &o->queue[i];
+        size_t end = q->head;
+        long taken = 0;
+
+        if (i != OUT_CONTROL && o->credit == 0)
+            break;
+
+        while (end < q->len) {
+            uint16_t len;
+            memcpy (&len, q->data + end, sizeof (len));
+            size_t sz = sizeof (len) + be16toh (len);
+            if (wr->len + (end - q->head) + sz > o->write_max && wr->len + end > q->head)
+                break;
+            if (i != OUT_CONTROL && o->credit >= 0 && taken == o->credit)
+                break;
+            end += sz;
+            taken++;
+        }
+
+        size_t n = end - q->head;
+        if (n > 0) {
+            buf_reserve (wr, n);
+            memcpy (wr->data + wr->len, q->data + q->head, n);
+            wr->len += n;
+            q->head = end;
+            if (q->head == q->len) {
+                q->head = q->len = 0;
+                if (i == OUT_LOW)
+                    o->last_low = (size_t) -1;
+            }
+        }
+
+        if (i != OUT_CONTROL && o->credit > 0) {
+            o->credit -= taken;
+            if (o->credit == 0 && o->passive != NULL) {
+                uint16_t len = htobe16 (o->passive_len);
+                buf_reserve (wr, sizeof (len) + o->passive_len);
+                memcpy (wr->data + wr->len, &len, sizeof (len));
+                memcpy (wr->data + wr->len + sizeof (len), o->passive, o->passive_len);
+                wr->len += sizeof (len) + o->passive_len;
+            }
+        }
+
+        if (wr->len >= o->write_max)
+            break;
+    }
+}
+
+static void
+write_done (struct evl_inst *loop, int res, void *arg)
+{
+    struct out *o = arg;
+
+    if (res < 0) {
+        if (res == -EINTR) {
+            write_next (o);
+            return;
+        }
+        if (res == -EAGAIN) {
+            o->blocked = 1;
+            evl_mod (o->loop, o->eh, EPOLLOUT);
+            return;
+        }
+        ERR ("write: %s", strerror (-res));
+        fail (o, -res);
+        return;
+    }
+
+    o->wr.head += res;
+    if (o->wr.head < o->wr.len) {
+        write_next (o);
+        return;
+    }
+
+    o->busy = 0;
+    o->wr.head = o->wr.len = 0;
+
+    /* continue with the rest of the queues */
+    out_flush (o);
+}
+
+static void
+write_next (struct out *o)
+{
+    int rc = evl_write (o->loop, o->fd, o->wr.data + o->wr.head,
+                        o->wr.len - o->wr.head, &write_done, o);
+    if (rc == -1) {
+        ERR ("evl_write: %s", strerror (errno));
+        fail (o, errno);
+    }
+}
+
+/* Writes the queued messages until the queues are empty, the descriptor
+ * would block or a write is in flight. */
+void
+out_flush (struct out *o)
+{
+    if (o->flushing)
+        return;
+    o->flushing = 1;
+
+    while (!o->busy && !o->blocked && !o->failed) {
+        fill (o);
+        if (o->wr.len == 0)
+            break;
+
+        o->busy = 1;
+        write_next (o);
+    }
+
+    o->flushing = 0;
+}
+
+/* Checks if a write is in flight (the output can not be freed yet). */
+int
+out_busy (const struct out *o)
+{
+    return o->busy && !o->blocked;
+}
+
+/* Checks if everything queued has been written. */
+int
+out_idle (const struct out *o)
+{
+    if (o->busy)
+        return 0;
+
+    for (int i = 0; i < OUT_NCLASSES; i++) {
+        if (out_queued (o, i) > 0)
+            return 0;
+    }
+
+    return 1;
+}
+
+/* Returns number of queued bytes in the class. */
+size_t
+out_queued (const struct out *o, int cls)
+{
+    return o->queue[cls].len - o->queue[cls].head;
+}
+
+unsigned long
+out_coalesced (const struct out *o)
+{
+    return o->coalesced;
+}
+
+/* Returns number of times the event backlog was dropped. */
+unsigned long
+out_dropped (const struct out *o)
+{
+    return o->dropped;
+}
+
+/* Returns number of queued event bytes. */
+size_t
+out_backlog (const struct out *o)
+{
+    size_t n = 0;
+
+    for (int i = OUT_REPLAY; i < OUT_NCLASSES; i++)
+        n += out_queued (o, i);
+
+    return n;
+}
+
+/* Discards the queued event messages (replies are kept). */
+void
+out_drop (struct out *o)
+{
+    for (int i = OUT_REPLAY; i < OUT_NCLASSES; i++)
+        o->queue[i].head = o->queue[i].len = 0;
+    o->last_low = (size_t) -1;
+    o->dropped++;
+}
+
+/**
+ * Sets number of event messages that may be written, -1 for unlimited.
+ */
+void
+out_set_credit (struct out *o, long credit)
+{
+    o->credit = credit;
+}
+
+long
+out_credit (const struct out *o)
+{
+    return o->credit;
+}
+
+/* Sets message written when the credits run out. */
+void
+out_set_passive (struct out *o, const void *buf, uint16_t count)
+{
+    free (o->passive);
+    o->passive = malloc (count);
+    assert (o->passive != NULL);
+    memcpy (o->passive, buf, count);
+    o->passive_len = count;
+}
+
+/* Sets maximum number of bytes written at once (at least one message). */
+void
+out_set_write_max (struct out *o, size_t sz)
+{
+    o->write_max = sz;
+}
+
+/* Sets low priority queue size above which duplicates are coalesced. */
+void
+out_set_coalesce (struct out *o, size_t sz)
+{
+    o->coalesce = sz;
+}
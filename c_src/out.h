@@ -0,0 +1,75 @@
+#ifndef _OUT_H
+#define _OUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "evl.h"
+
+/* output classes in the order they are written */
+enum {
+    OUT_CONTROL = 0, /* replies and port messages */
+    OUT_REPLAY,      /* replayed events and snapshots (ahead of live events) */
+    OUT_HIGH,
+    OUT_NORMAL,
+    OUT_LOW,
+    OUT_NCLASSES
+};
+
+struct out;
+
+/* error callback prototype */
+typedef void (out_error_fn) (void *arg, int err);
+
+extern struct out *
+out_new (struct evl_inst *loop, int fd, out_error_fn *on_error, void *arg);
+
+extern void
+out_free (struct out *o);
+
+extern void
+out_put (struct out *o, int cls, const void *buf, uint16_t count);
+
+extern void
+out_put_key (struct out *o, int cls, const void *buf, uint16_t count, uint16_t key);
+
+extern void
+out_flush (struct out *o);
+
+extern int
+out_busy (const struct out *o);
+
+extern int
+out_idle (const struct out *o);
+
+extern size_t
+out_queued (const struct out *o, int cls);
+
+extern size_t
+out_backlog (const struct out *o);
+
+extern void
+out_drop (struct out *o);
+
+extern unsigned long
+out_coalesced (const struct out *o);
+
+extern unsigned long
+out_dropped (const struct out *o);
+
+extern void
+out_set_credit (struct out *o, long credit);
+
+extern long
+out_credit (const struct out *o);
+
+extern void
+out_set_passive (struct out *o, const void *buf, uint16_t count);
+
+extern void
+out_set_write_max (struct out *o, size_t sz);
+
+extern void
+out_set_coalesce (struct out *o, size_t sz);
+
+#endif /* _OUT_H */
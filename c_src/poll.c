@@ -0,0 +1,638 @@
+/**
+ * @file poll.c
+ *
+ * @brief Polling backend for file systems without inotify support.
+ *
+ * Watches added with the `poll' option are not registered with inotify.
+ * Instead the directory is rescanned with getdents64()/statx() and the
+ * result is compared with the snapshot of the previous scan; differences
+ * are sent as ordinary events (renames are seen as delete + create).  Poll
+ * watches have negative descriptors so they never collide with inotify ones.
+ *
+ * Scans are incremental: at most POLL_BATCH entries are examined per timer
+ * tick, a large directory is finished in later ticks.  The first scan is the
+ * baseline and sends no events.  Content changes are reported as IN_MODIFY
+ * and, for regular files, IN_CLOSE_WRITE (closing can not be seen).  After a scan without
+ * changes the interval of the watch doubles (up to POLL_MAX_MS), after any
+ * change it drops back to the minimum, so idle trees are rarely scanned.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#define _GNU_SOURCE /* for TEMP_FAILURE_RETRY */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "chain.h"
+#include "control.h"
+#include "log.h"
+#include "out.h"
+#include "poll.h"
+#include "watch.h"
+
+/* default (minimum) and maximum poll intervals (milliseconds) */
+#define POLL_MIN_MS 1000
+#define POLL_MAX_MS 60000
+/* maximum number of entries examined per tick */
+#define POLL_BATCH 1024
+/* delay before continuing an unfinished scan (milliseconds) */
+#define POLL_STEP_MS 10
+/* getdents64 buffer size */
+#define DENTS_SZ 32768
+
+#define STATX_MASK (STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME \
+                    | STATX_CTIME | STATX_INO)
+
+struct linux_dirent64 {
+    ino64_t        d_ino;
+    off64_t        d_off;
+    unsigned short d_reclen;
+    unsigned char  d_type;
+    char           d_name[];
+};
+
+/* snapshot entry */
+struct ent {
+    char     *name;
+    uint64_t ino;
+    uint64_t size;
+    int64_t  mtime_sec;
+    uint32_t mtime_nsec;
+    int64_t  ctime_sec;
+    uint32_t ctime_nsec;
+    uint16_t mode;
+};
+
+struct snap {
+    struct ent *ents;
+    size_t     n;
+    size_t     cap;
+};
+
+struct pwatch {
+    struct pwatch *prev;
+    struct pwatch *next;
+    int           wd;
+    uint32_t      mask;
+    unsigned int  flags;
+    int           prio;
+    char          *path;
+    /* poll watches are not shared by clients */
+    struct client *c;
+    int           isdir;
+    /* statx() flags for the path (IN_DONT_FOLLOW) */
+    int           follow;
+    /* the first scan is in progress */
+    int           baseline;
+    /* snapshot of the last complete scan (the path itself for files) */
+    struct snap   snap;
+    struct ent    self;
+    /* scan in progress */
+    int           dfd;
+    char          *dents;
+    long          dpos;
+    long          dlen;
+    struct snap   scan;
+    /* scheduling */
+    unsigned int  min_ms;
+    unsigned int  interval;
+    uint64_t      due;
+};
+
+static struct evl_handler *eh = NULL;
+static struct pwatch *pwatches = NULL;
+static int last_wd = 0;
+static unsigned long nwatches = 0;
+static unsigned long nscans = 0;
+static unsigned long nstats = 0;
+
+static inline uint64_t
+now_ms (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Arms the timer for the earliest due watch. */
+static void
+timer_update (void)
+{
+    struct itimerspec its;
+    struct pwatch *p;
+    uint64_t due = 0;
+
+    chain_for_each (pwatches, p) {
+        if (due == 0 || p->due < due)
+            due = p->due;
+    }
+
+    memset (&its, 0, sizeof (its));
+    if (due) {
+        its.it_value.tv_sec  = due / 1000;
+        its.it_value.tv_nsec = (due % 1000) * 1000000 + 1;
+    }
+
+    if (timerfd_settime (eh->fd, TFD_TIMER_ABSTIME, &its, NULL) == -1)
+        ERR ("timerfd_settime: %s", strerror (errno));
+}
+
+static void
+ent_set (struct ent *e, const struct statx *stx)
+{
+    e->ino        = stx->stx_ino;
+    e->size       = stx->stx_size;
+    e->mtime_sec  = stx->stx_mtime.tv_sec;
+    e->mtime_nsec = stx->stx_mtime.tv_nsec;
+    e->ctime_sec  = stx->stx_ctime.tv_sec;
+    e->ctime_nsec = stx->stx_ctime.tv_nsec;
+    e->mode       = stx->stx_mode;
+}
+
+static void
+snap_clear (struct snap *s)
+{
+    for (size_t i = 0; i < s->n; i++)
+        free (s->ents[i].name);
+    free (s->ents);
+    memset (s, 0, sizeof (*s));
+}
+
+static struct ent *
+snap_add (struct snap *s, const char *name)
+{
+    if (s->n == s->cap) {
+        s->cap  = s->cap ? s->cap * 2 : 64;
+        s->ents = realloc (s->ents, s->cap * sizeof (*s->ents));
+        assert (s->ents != NULL);
+    }
+
+    struct ent *e = &s->ents[s->n++];
+    e->name = strdup (name);
+    assert (e->name != NULL);
+
+    return e;
+}
+
+static int
+ent_cmp (const void *a, const void *b)
+{
+    return strcmp (((const struct ent *) a)->name, ((const struct ent *) b)->name);
+}
+
+/* Sends event for the entry (NULL name for the watched path itself). */
+static void
+emit (struct pwatch *p, uint32_t mask, const struct ent *e, const char *name)
+{
+    struct statx stx, *sp = NULL;
+
+    if (!(mask & (p->mask | IN_IGNORED)))
+        return;
+
+    if (S_ISDIR (e->mode) && name != NULL)
+        mask |= IN_ISDIR;
+
+    if ((p->flags & WATCH_F_STAT) && !(mask & (IN_DELETE | IN_DELETE_SELF | IN_IGNORED))) {
+        memset (&stx, 0, sizeof (stx));
+        stx.stx_mode          = e->mode;
+        stx.stx_size          = e->size;
+        stx.stx_mtime.tv_sec  = e->mtime_sec;
+        stx.stx_mtime.tv_nsec = e->mtime_nsec;
+        stx.stx_ino           = e->ino;
+        sp = &stx;
+    }
+
+    control_notify (OUT_HIGH + p->prio, p->wd, mask, 0, name,
+                    name ? strlen (name) + 1 : 0, sp);
+}
+
+/* Compares entry attributes, returns the event mask (0 if unchanged). */
+static uint32_t
+ent_diff (const struct ent *o, const struct ent *n)
+{
+    if (o->mtime_sec != n->mtime_sec || o->mtime_nsec != n->mtime_nsec
+        || o->size != n->size)
+        return IN_MODIFY;
+    if (o->ctime_sec != n->ctime_sec || o->ctime_nsec != n->ctime_nsec
+        || o->mode != n->mode)
+        return IN_ATTRIB;
+    return 0;
+}
+
+/* Sends change of the entry. */
+static void
+emit_diff (struct pwatch *p, uint32_t mask, const struct ent *e, const char *name)
+{
+    emit (p, mask, e, name);
+    if (mask == IN_MODIFY && S_ISREG (e->mode))
+        emit (p, IN_CLOSE_WRITE, e, name);
+}
+
+/* Replaces the snapshot with the finished scan. */
+static void
+snap_swap (struct pwatch *p)
+{
+    snap_clear (&p->snap);
+    p->snap = p->scan;
+    memset (&p->scan, 0, sizeof (p->scan));
+}
+
+/* Emits differences between the snapshot and the finished scan. */
+static int
+diff (struct pwatch *p)
+{
+    struct snap *o = &p->snap, *n = &p->scan;
+    size_t i = 0, j = 0;
+    int changes = 0;
+
+    qsort (n->ents, n->n, sizeof (*n->ents), &ent_cmp);
+
+    while (i < o->n || j < n->n) {
+        int c = i == o->n ? 1 : j == n->n ? -1
+                : strcmp (o->ents[i].name, n->ents[j].name);
+
+        if (c < 0) {
+            emit (p, IN_DELETE, &o->ents[i], o->ents[i].name);
+            i++;
+            changes++;
+        } else if (c > 0) {
+            emit (p, IN_CREATE, &n->ents[j], n->ents[j].name);
+            j++;
+            changes++;
+        } else {
+            if (o->ents[i].ino != n->ents[j].ino) {
+                emit (p, IN_DELETE, &o->ents[i], o->ents[i].name);
+                emit (p, IN_CREATE, &n->ents[j], n->ents[j].name);
+                changes++;
+            } else {
+                uint32_t m = ent_diff (&o->ents[i], &n->ents[j]);
+                if (m) {
+                    emit_diff (p, m, &n->ents[j], n->ents[j].name);
+                    changes++;
+                }
+            }
+            i++;
+            j++;
+        }
+    }
+
+    snap_swap (p);
+
+    return changes;
+}
+
+static void
+scan_abort (struct pwatch *p)
+{
+    if (p->dfd != -1) {
+        TEMP_FAILURE_RETRY (close (p->dfd));
+        p->dfd = -1;
+    }
+    p->dpos = p->dlen = 0;
+    snap_clear (&p->scan);
+}
+
+static void
+pwatch_free (struct pwatch *p)
+{
+    chain_del (pwatches, p);
+    nwatches--;
+    scan_abort (p);
+    snap_clear (&p->snap);
+    free (p->dents);
+    free (p->path);
+    free (p);
+}
+
+/* The watched path is gone: emits IN_DELETE_SELF and IN_IGNORED. */
+static void
+gone (struct pwatch *p)
+{
+    emit (p, IN_DELETE_SELF, &p->self, NULL);
+    emit (p, IN_IGNORED, &p->self, NULL);
+    pwatch_free (p);
+}
+
+/**
+ * Continues the scan of the watch examining up to @a budget entries.
+ *
+ * @return number of examined entries, -1 if the watch is gone
+ */
+static int
+scan_step (struct pwatch *p, int budget, int *done)
+{
+    struct statx stx;
+    int count = 0;
+
+    *done = 0;
+
+    if (p->dfd == -1) {
+        if (statx (AT_FDCWD, p->path, p->follow, STATX_MASK, &stx) == -1
+            || stx.stx_ino != p->self.ino) {
+            return -1;
+        }
+        nstats++;
+
+        ent_set (&p->self, &stx);
+        if (!p->isdir) {
+            *done = 1;
+            return 1;
+        }
+
+        p->dfd = openat (AT_FDCWD, p->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (p->dfd == -1)
+            return -1;
+        p->dpos = p->dlen = 0;
+    }
+
+    while (count < budget) {
+        if (p->dpos >= p->dlen) {
+            long n = TEMP_FAILURE_RETRY (syscall (SYS_getdents64, p->dfd, p->dents, DENTS_SZ));
+            if (n <= 0) {
+                if (n == -1)
+                    WARNING ("getdents64 (%s): %s", p->path, strerror (errno));
+                TEMP_FAILURE_RETRY (close (p->dfd));
+                p->dfd = -1;
+                *done = 1;
+                break;
+            }
+            p->dpos = 0;
+            p->dlen = n;
+        }
+
+        struct linux_dirent64 *d = (void *) (p->dents + p->dpos);
+        p->dpos += d->d_reclen;
+
+        const char *name = d->d_name;
+        if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0)))
+            continue;
+
+        count++;
+        nstats++;
+        if (statx (p->dfd, name, AT_SYMLINK_NOFOLLOW, STATX_MASK, &stx) == -1)
+            continue; /* removed meanwhile */
+
+        ent_set (snap_add (&p->scan, name), &stx);
+    }
+
+    return count;
+}
+
+/* Runs the watch's scan, returns number of examined entries. */
+static int
+poll_watch (struct pwatch *p, uint64_t now, int budget)
+{
+    uint32_t mask = 0;
+    struct ent old = p->self;
+    int done;
+
+    int n = scan_step (p, budget, &done);
+    if (n == -1) {
+        gone (p);
+        return 1;
+    }
+
+    if (!done) {
+        p->due = now + POLL_STEP_MS;
+        return n;
+    }
+
+    nscans++;
+
+    int changes;
+    if (p->baseline) {
+        qsort (p->scan.ents, p->scan.n, sizeof (*p->scan.ents), &ent_cmp);
+        snap_swap (p);
+        p->baseline = 0;
+        changes = 1;
+    } else if (p->isdir) {
+        changes = diff (p);
+    } else {
+        mask = ent_diff (&old, &p->self);
+        if (mask)
+            emit_diff (p, mask, &p->self, NULL);
+        changes = mask != 0;
+    }
+
+    if (changes) {
+        p->interval = p->min_ms;
+    } else if (p->interval < POLL_MAX_MS) {
+        p->interval *= 2;
+        if (p->interval > POLL_MAX_MS)
+            p->interval = POLL_MAX_MS;
+    }
+    p->due = now + p->interval;
+
+    return n;
+}
+
+static void
+poll_handler (struct evl_handler *eh, uint32_t _events, void *_nil)
+{
+    uint64_t cnt;
+    struct pwatch *p, *next;
+
+    if (TEMP_FAILURE_RETRY (read (eh->fd, &cnt, sizeof (cnt))) == -1) {
+        if (errno != EAGAIN)
+            ERR ("read (timerfd): %s", strerror (errno));
+        return;
+    }
+
+    uint64_t now = now_ms ();
+    int budget = POLL_BATCH;
+
+    chain_for_each_safe (pwatches, p, next) {
+        if (budget <= 0)
+            break;
+        if (p->due <= now)
+            budget -= poll_watch (p, now, budget);
+    }
+
+    timer_update ();
+}
+
+int
+poll_init (struct evl_inst *loop)
+{
+    assert (eh == NULL);
+
+    int tfd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (tfd == -1) {
+        ERR ("timerfd_create: %s", strerror (errno));
+        return -1;
+    }
+
+    eh = evl_add (loop, tfd, EPOLLIN, &poll_handler, NULL);
+    assert (eh != NULL);
+
+    return 0;
+}
+
+void
+poll_destroy (struct evl_inst *loop)
+{
+    while (pwatches)
+        pwatch_free (pwatches);
+
+    if (eh != NULL) {
+        evl_del (loop, eh);
+        TEMP_FAILURE_RETRY (close (eh->fd));
+        eh = NULL;
+    }
+}
+
+static struct pwatch *
+pwatch_get (int wd)
+{
+    struct pwatch *p;
+
+    chain_for_each (pwatches, p) {
+        if (p->wd == wd)
+            return p;
+    }
+
+    return NULL;
+}
+
+/**
+ * Adds poll mode watch for @a path.  The baseline scan is started at once
+ * and continued from the timer like the following ones.  Hashing, rate
+ * limiting and eviction are not supported (EINVAL).
+ *
+ * @return negative watch descriptor, or -1 with errno set on error
+ */
+int
+poll_add (const char *path, uint32_t mask, const struct watch_opts *opts,
+          struct client *c)
+{
+    struct statx stx;
+    struct pwatch *p;
+
+    assert (eh != NULL);
+
+    if ((opts->flags & WATCH_F_HASH) || opts->rate || opts->evictable || opts->ttl) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int follow = (mask & IN_DONT_FOLLOW) ? AT_SYMLINK_NOFOLLOW : 0;
+    if (statx (AT_FDCWD, path, follow, STATX_MASK, &stx) == -1)
+        return -1;
+    if ((mask & IN_ONLYDIR) && !S_ISDIR (stx.stx_mode)) {
+        errno = ENOTDIR;
+        return -1;
+    }
+
+    /* the same path is watched by the client already: update it */
+    chain_for_each (pwatches, p) {
+        if (p->c == c && strcmp (p->path, path) == 0)
+            break;
+    }
+
+    if (p == NULL) {
+        p = calloc (1, sizeof (*p));
+        assert (p != NULL);
+
+        /* -1 is reserved for errors */
+        if (--last_wd >= -1)
+            last_wd = -2;
+        p->wd       = last_wd;
+        p->c        = c;
+        p->path     = strdup (path);
+        p->dfd      = -1;
+        p->isdir    = S_ISDIR (stx.stx_mode);
+        p->follow   = follow;
+        p->baseline = 1;
+        assert (p->path != NULL);
+        ent_set (&p->self, &stx);
+
+        /* opened here, so errors are reported to the caller */
+        if (p->isdir) {
+            p->dfd = openat (AT_FDCWD, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (p->dfd == -1) {
+                int tmp = errno;
+                free (p->path);
+                free (p);
+                errno = tmp;
+                return -1;
+            }
+            p->dents = malloc (DENTS_SZ);
+            assert (p->dents != NULL);
+        }
+
+        chain_add (pwatches, p);
+        nwatches++;
+    }
+
+    p->mask     = (mask & IN_MASK_ADD) ? (p->mask | mask) : mask;
+    p->mask    &= ~IN_MASK_ADD;
+    p->flags    = opts->flags;
+    p->prio     = opts->prio;
+    p->min_ms   = opts->poll_ms ? opts->poll_ms : POLL_MIN_MS;
+    p->interval = p->min_ms;
+    /* the baseline (or an unfinished scan) goes on right away */
+    p->due      = now_ms () + (p->baseline || p->dfd != -1 ? 0 : p->interval);
+
+    timer_update ();
+
+    return p->wd;
+}
+
+/* Removes poll mode watch, IN_IGNORED is sent as for inotify watches. */
+int
+poll_rm (int wd, struct client *c)
+{
+    struct pwatch *p = pwatch_get (wd);
+
+    if (p == NULL || p->c != c) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    emit (p, IN_IGNORED, &p->self, NULL);
+    pwatch_free (p);
+    timer_update ();
+
+    return 0;
+}
+
+/* Returns the client of the poll mode watch (NULL if unknown). */
+struct client *
+poll_client (int wd)
+{
+    struct pwatch *p = pwatch_get (wd);
+
+    return p ? p->c : NULL;
+}
+
+/* Removes poll mode watches of the client (it is gone). */
+void
+poll_drop_client (struct client *c)
+{
+    struct pwatch *p, *next;
+
+    chain_for_each_safe (pwatches, p, next) {
+        if (p->c == c)
+            pwatch_free (p);
+    }
+    timer_update ();
+}
+
+void
+poll_get_stats (struct poll_stats *st)
+{
+    st->watches = nwatches;
+    st->scans   = nscans;
+    st->stats   = nstats;
+}
@@ -0,0 +1,37 @@
+#ifndef _POLL_H
+#define _POLL_H
+
+#include "evl.h"
+
+struct client;
+struct watch_opts;
+
+struct poll_stats {
+    unsigned long watches;
+    unsigned long scans;
+    unsigned long stats;
+};
+
+extern int
+poll_init (struct evl_inst *loop);
+
+extern void
+poll_destroy (struct evl_inst *loop);
+
+extern int
+poll_add (const char *path, uint32_t mask, const struct watch_opts *opts,
+          struct client *c);
+
+extern int
+poll_rm (int wd, struct client *c);
+
+extern struct client *
+poll_client (int wd);
+
+extern void
+poll_drop_client (struct client *c);
+
+extern void
+poll_get_stats (struct poll_stats *st);
+
+#endif /* _POLL_H */
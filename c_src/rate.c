@@ -0,0 +1,273 @@
+/**
+ * @file rate.c
+ *
+ * @brief Per subscription rate limiting with summary events.
+ *
+ * Every rate limited subscription of a watch has a token bucket.  When it
+ * runs dry the subscription switches to summary mode: events are only
+ * counted (per mask bit) and the names of the affected entries are collected
+ * up to a limit.  A timer emits one #einotify_summary{} per subscription and
+ * period; full delivery resumes after a period in which the subscriber
+ * stayed within its rate.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#define _GNU_SOURCE /* for TEMP_FAILURE_RETRY */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "chain.h"
+#include "control.h"
+#include "log.h"
+#include "out.h"
+#include "rate.h"
+#include "watch.h"
+
+/* summary period (milliseconds) */
+#define PERIOD_MS 1000
+
+struct rate {
+    /* chain of buckets in summary mode */
+    struct rate   *prev;
+    struct rate   *next;
+    struct watch  *w;
+    struct sub    *s;
+    /* bucket parameters (events per second, bucket size) */
+    double        rate;
+    double        burst;
+    double        tokens;
+    uint64_t      stamp;
+    /* summary mode */
+    int           limited;
+    unsigned long events;
+    unsigned long counts[32];
+    unsigned int  max_names;
+    unsigned int  nnames;
+    int           truncated;
+    char          **names;
+};
+
+static struct evl_handler *eh = NULL;
+static struct rate *limited = NULL;
+
+static inline uint64_t
+now_ms (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+timer_set (int on)
+{
+    struct itimerspec its;
+
+    memset (&its, 0, sizeof (its));
+    if (on) {
+        its.it_value.tv_sec     = PERIOD_MS / 1000;
+        its.it_value.tv_nsec    = (PERIOD_MS % 1000) * 1000000;
+        its.it_interval         = its.it_value;
+    }
+
+    if (timerfd_settime (eh->fd, 0, &its, NULL) == -1)
+        ERR ("timerfd_settime: %s", strerror (errno));
+}
+
+static void
+names_reset (struct rate *r)
+{
+    for (unsigned int i = 0; i < r->nnames; i++)
+        free (r->names[i]);
+    r->nnames    = 0;
+    r->truncated = 0;
+}
+
+static void
+names_add (struct rate *r, const char *name)
+{
+    for (unsigned int i = 0; i < r->nnames; i++) {
+        if (strcmp (r->names[i], name) == 0)
+            return;
+    }
+
+    if (r->nnames == r->max_names) {
+        r->truncated = 1;
+        return;
+    }
+
+    r->names[r->nnames] = strdup (name);
+    assert (r->names[r->nnames] != NULL);
+    r->nnames++;
+}
+
+/* Sends summary for the last period and resets counters. */
+static void
+summary (struct rate *r)
+{
+    if (r->events == 0)
+        return;
+
+    control_summary (r->s->c, OUT_HIGH + r->s->prio, r->w->wd, r->counts,
+                     (const char *const *) r->names, r->nnames, r->truncated);
+
+    memset (r->counts, 0, sizeof (r->counts));
+    names_reset (r);
+    r->events = 0;
+}
+
+static void
+rate_handler (struct evl_handler *eh, uint32_t _events, void *_nil)
+{
+    uint64_t cnt;
+    struct rate *r, *next;
+
+    if (TEMP_FAILURE_RETRY (read (eh->fd, &cnt, sizeof (cnt))) == -1) {
+        if (errno != EAGAIN)
+            ERR ("read (timerfd): %s", strerror (errno));
+        return;
+    }
+
+    chain_for_each_safe (limited, r, next) {
+        /* number of events the bucket would have allowed in the period */
+        int calm = r->events <= r->rate * PERIOD_MS / 1000 * cnt;
+
+        summary (r);
+
+        if (calm) {
+            DEBUG ("%s: wd %d is back to normal", __func__, r->w->wd);
+            r->limited = 0;
+            r->tokens  = r->burst;
+            r->stamp   = now_ms ();
+            chain_del (limited, r);
+        }
+    }
+
+    if (limited == NULL)
+        timer_set (0);
+}
+
+int
+rate_init (struct evl_inst *loop)
+{
+    assert (eh == NULL);
+
+    int tfd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (tfd == -1) {
+        ERR ("timerfd_create: %s", strerror (errno));
+        return -1;
+    }
+
+    eh = evl_add (loop, tfd, EPOLLIN, &rate_handler, NULL);
+    assert (eh != NULL);
+
+    return 0;
+}
+
+void
+rate_destroy (struct evl_inst *loop)
+{
+    if (eh != NULL) {
+        evl_del (loop, eh);
+        TEMP_FAILURE_RETRY (close (eh->fd));
+        eh = NULL;
+    }
+}
+
+/**
+ * Creates token bucket for the subscription @a s of the watch @a w: @a rate
+ * events per second with bursts of up to @a burst events; summaries carry up
+ * to @a names names.
+ */
+struct rate *
+rate_new (struct watch *w, struct sub *s, unsigned int rate, unsigned int burst,
+          unsigned int names)
+{
+    struct rate *r = calloc (1, sizeof (*r));
+    assert (r != NULL);
+
+    r->w         = w;
+    r->s         = s;
+    r->rate      = rate;
+    r->burst     = burst ? burst : rate;
+    r->tokens    = r->burst;
+    r->stamp     = now_ms ();
+    r->max_names = names;
+    r->names     = calloc (names ? names : 1, sizeof (*r->names));
+    assert (r->names != NULL);
+
+    return r;
+}
+
+/* Returns parameters the bucket was created with. */
+void
+rate_params (const struct rate *r, unsigned int *rate, unsigned int *burst,
+             unsigned int *names)
+{
+    *rate  = r->rate;
+    *burst = r->burst;
+    *names = r->max_names;
+}
+
+/* Sends pending summary and frees the bucket. */
+void
+rate_free (struct rate *r)
+{
+    if (r->limited) {
+        summary (r);
+        chain_del (limited, r);
+        if (limited == NULL)
+            timer_set (0);
+    }
+
+    names_reset (r);
+    free (r->names);
+    free (r);
+}
+
+/**
+ * Accounts the event.
+ *
+ * @return non-zero if the event must not be sent (it is summarized)
+ */
+int
+rate_limited (struct rate *r, const struct inotify_event *event)
+{
+    if (!r->limited) {
+        uint64_t now = now_ms ();
+
+        r->tokens += (now - r->stamp) * r->rate / 1000;
+        if (r->tokens > r->burst)
+            r->tokens = r->burst;
+        r->stamp = now;
+
+        if (r->tokens >= 1) {
+            r->tokens -= 1;
+            return 0;
+        }
+
+        DEBUG ("%s: wd %d exceeded its rate", __func__, r->w->wd);
+        r->limited = 1;
+        if (limited == NULL)
+            timer_set (1);
+        chain_add (limited, r);
+    }
+
+    r->events++;
+    for (int i = 0; i < 32; i++) {
+        if (event->mask & (1U << i))
+            r->counts[i]++;
+    }
+    if (event->len)
+        names_add (r, event->name);
+
+    return 1;
+}
@@ -0,0 +1,32 @@
+#ifndef _RATE_H
+#define _RATE_H
+
+#include <sys/inotify.h>
+
+#include "evl.h"
+
+struct rate;
+struct sub;
+struct watch;
+
+extern int
+rate_init (struct evl_inst *loop);
+
+extern void
+rate_destroy (struct evl_inst *loop);
+
+extern struct rate *
+rate_new (struct watch *w, struct sub *s, unsigned int rate, unsigned int burst,
+          unsigned int names);
+
+extern void
+rate_params (const struct rate *r, unsigned int *rate, unsigned int *burst,
+             unsigned int *names);
+
+extern void
+rate_free (struct rate *r);
+
+extern int
+rate_limited (struct rate *r, const struct inotify_event *event);
+
+#endif /* _RATE_H */
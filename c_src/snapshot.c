@@ -0,0 +1,112 @@
+/**
+ * @file snapshot.c
+ *
+ * @brief Initial state of a directory for watches added with `snapshot'.
+ *
+ * The directory is listed after the watch is installed, and the entries are
+ * sent as synthetic IN_CREATE events in #einotify_snapshot{} chunks.  The
+ * chunks are queued in the replay class, which is written ahead of the event
+ * classes, so they come before any live event of the watch (which can only
+ * be read from inotify in a later loop iteration).  Like events, every chunk
+ * consumes a credit, so a passive owner gets them when it grants more.
+ * Entries created meanwhile may appear both in the snapshot and as live
+ * IN_CREATE events, but none is lost.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#define _GNU_SOURCE /* for TEMP_FAILURE_RETRY */
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "control.h"
+#include "log.h"
+#include "snapshot.h"
+
+/* number of entries collected before they are passed for sending */
+#define BATCH_SZ 256
+/* getdents64 buffer size */
+#define DENTS_SZ 32768
+
+struct linux_dirent64 {
+    ino64_t        d_ino;
+    off64_t        d_off;
+    unsigned short d_reclen;
+    unsigned char  d_type;
+    char           d_name[];
+};
+
+static void
+batch_flush (int wd, struct snapshot_ent *ents, int *n, int last)
+{
+    control_snapshot (wd, ents, *n, last);
+
+    for (int i = 0; i < *n; i++)
+        free (ents[i].name);
+    *n = 0;
+}
+
+/**
+ * Sends entries of the directory @a path for the watch @a wd.  The last
+ * chunk is always sent (possibly empty, e.g. when @a path is not a directory).
+ */
+void
+snapshot_send (int wd, const char *path)
+{
+    static char dents[DENTS_SZ];
+    struct snapshot_ent ents[BATCH_SZ];
+    int n = 0;
+
+    int dfd = openat (AT_FDCWD, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd == -1) {
+        DEBUG ("%s: open (%s): %s", __func__, path, strerror (errno));
+        batch_flush (wd, ents, &n, 1);
+        return;
+    }
+
+    for (;;) {
+        long len = TEMP_FAILURE_RETRY (syscall (SYS_getdents64, dfd, dents, DENTS_SZ));
+        if (len <= 0) {
+            if (len == -1)
+                WARNING ("getdents64 (%s): %s", path, strerror (errno));
+            break;
+        }
+
+        for (long off = 0; off < len;) {
+            struct linux_dirent64 *d = (void *) (dents + off);
+            off += d->d_reclen;
+
+            const char *name = d->d_name;
+            if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0)))
+                continue;
+
+            int dir = d->d_type == DT_DIR;
+            if (d->d_type == DT_UNKNOWN) {
+                struct stat st;
+                dir = fstatat (dfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0
+                      && S_ISDIR (st.st_mode);
+            }
+
+            if (n == BATCH_SZ)
+                batch_flush (wd, ents, &n, 0);
+
+            ents[n].mask = IN_CREATE | (dir ? IN_ISDIR : 0);
+            ents[n].name = strdup (name);
+            assert (ents[n].name != NULL);
+            n++;
+        }
+    }
+
+    TEMP_FAILURE_RETRY (close (dfd));
+    batch_flush (wd, ents, &n, 1);
+}
@@ -0,0 +1,15 @@
+#ifndef _SNAPSHOT_H
+#define _SNAPSHOT_H
+
+#include <stdint.h>
+
+/* directory entry as a synthetic event */
+struct snapshot_ent {
+    uint32_t mask;
+    char     *name;
+};
+
+extern void
+snapshot_send (int wd, const char *path);
+
+#endif /* _SNAPSHOT_H */
@@ -6,23 +6,356 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include "budget.h"
+#include "chain.h"
+#include "checkpoint.h"
 #include "control.h"
+#include "crawl.h"
+#include "dedup.h"
 #include "log.h"
+#include "out.h"
+#include "poll.h"
+#include "rate.h"
 #include "watch.h"
 
 static struct evl_handler *eh = NULL;
+static struct evl_inst *eloop = NULL;
+/* reading stopped (events already returned by the loop are left too) */
+static int paused = 0;
+
+/* event of a watch descriptor not tracked yet (see hold ()) */
+struct held {
+    struct held *prev;
+    struct held *next;
+    char        data[];
+};
+
+static struct held *held = NULL;
+
+/* watch table (hashed by watch descriptor) */
+static struct watch **table = NULL;
+static unsigned int nbuckets = 0;
+static unsigned int nwatches = 0;
+
+#define BUCKET(wd) (table[(unsigned int) (wd) & (nbuckets - 1)])
+
+static void
+table_grow (void)
+{
+    unsigned int old = nbuckets;
+    struct watch **otable = table;
+
+    nbuckets = old ? old * 2 : 256;
+    table = calloc (nbuckets, sizeof (*table));
+    assert (table != NULL);
+
+    for (unsigned int i = 0; i < old; i++) {
+        while (otable[i]) {
+            struct watch *w = otable[i];
+            chain_del (otable[i], w);
+            chain_add (BUCKET (w->wd), w);
+        }
+    }
+
+    free (otable);
+}
+
+struct watch *
+watch_get (int wd)
+{
+    struct watch *w;
+
+    if (nbuckets == 0)
+        return NULL;
+
+    chain_for_each (BUCKET (wd), w) {
+        if (w->wd == wd)
+            return w;
+    }
+
+    return NULL;
+}
+
+/**
+ * Records the watch @a wd in the watch table (or updates existing record).
+ * inotify_add_watch() returns the same descriptor for the same inode, so
+ * the mask is updated according to IN_MASK_ADD semantics.
+ */
+struct watch *
+watch_track (int wd, const char *path, uint32_t mask)
+{
+    struct watch *w = watch_get (wd);
+
+    if (w != NULL) {
+        w->mask = (mask & IN_MASK_ADD) ? (w->mask | mask) : mask;
+        w->mask &= ~IN_MASK_ADD;
+        if (strcmp (w->path, path) != 0) {
+            free (w->path);
+            w->path = strdup (path);
+            assert (w->path != NULL);
+        }
+        return w;
+    }
+
+    if (nwatches >= nbuckets * 2)
+        table_grow ();
+
+    w = calloc (1, sizeof (*w));
+    assert (w != NULL);
+    w->wd   = wd;
+    w->mask = mask & ~IN_MASK_ADD;
+    w->path = strdup (path);
+    assert (w->path != NULL);
+
+    chain_add (BUCKET (wd), w);
+    nwatches++;
+
+    return w;
+}
+
+/* Drops the subscription (its pending rate limit summary is sent). */
+static void
+sub_free (struct watch *w, struct sub *s)
+{
+    chain_del (w->subs, s);
+    if (s->rate)
+        rate_free (s->rate);
+    free (s);
+}
+
+void
+watch_forget (struct watch *w)
+{
+    struct sub *s, *next;
+
+    checkpoint_rm (w);
+    chain_del (BUCKET (w->wd), w);
+    if (!w->dead)
+        nwatches--;
+    chain_for_each_safe (w->subs, s, next)
+        sub_free (w, s);
+    if (w->budget)
+        budget_free (w->budget);
+    free (w->path);
+    free (w);
+}
+
+/* Builds full path of the event subject into `buf'. */
+static const char *
+event_path (const struct watch *w, const struct inotify_event *event,
+            char *buf, size_t sz)
+{
+    if (event->len == 0)
+        return w->path;
+
+    int n = snprintf (buf, sz, "%s/%s", w->path, event->name);
+    if (n < 0 || (size_t) n >= sz)
+        return NULL;
+
+    return buf;
+}
+
+/* events that are never rate limited */
+#define IN_CONTROL (IN_IGNORED | IN_Q_OVERFLOW | IN_UNMOUNT | IN_DELETE_SELF | IN_MOVE_SELF)
+
+/* Marks the subscriptions the event should not be sent to, returns non-zero
+ * if that is all of them.  Events dropped by hashing do not take rate limit
+ * tokens. */
+static int
+suppress (struct watch *w, const struct inotify_event *event)
+{
+    char path[PATH_MAX];
+    int unchanged = -1; /* content not hashed yet */
+    int all = w->subs != NULL;
+    struct sub *s;
+
+    chain_for_each (w->subs, s) {
+        s->skip = 0;
+
+        if ((s->flags & WATCH_F_HASH)
+            && (event->mask & IN_CLOSE_WRITE)
+            && !(event->mask & IN_ISDIR)) {
+            if (unchanged == -1) {
+                const char *p = event_path (w, event, path, sizeof (path));
+                unchanged = p != NULL && dedup_unchanged (w->wd, p);
+            }
+            s->skip = unchanged;
+        }
+
+        if (!s->skip && s->rate && (event->mask & s->mask) && !(event->mask & IN_CONTROL))
+            s->skip = rate_limited (s->rate, event);
+
+        all &= s->skip;
+    }
+
+    return all;
+}
+
+/* events for which the subject is already gone */
+#define IN_GONE (IN_DELETE | IN_DELETE_SELF | IN_MOVED_FROM | IN_IGNORED | IN_UNMOUNT)
+
+/* Fills `stx' for the event subject, returns NULL if no subscriber getting
+ * the event requested it or it failed. */
+static const struct statx *
+event_stat (const struct watch *w, const struct inotify_event *event,
+            struct statx *stx)
+{
+    char path[PATH_MAX];
+    const struct sub *s;
+
+    if (event->mask & IN_GONE)
+        return NULL;
+
+    chain_for_each (w->subs, s) {
+        if ((s->flags & WATCH_F_STAT) && !s->skip)
+            break;
+    }
+    if (s == NULL)
+        return NULL;
+
+    const char *p = event_path (w, event, path, sizeof (path));
+    if (p == NULL)
+        return NULL;
+
+    if (statx (AT_FDCWD, p, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+               STATX_TYPE | STATX_SIZE | STATX_MTIME | STATX_INO, stx) == -1) {
+        DEBUG ("%s: statx (%s): %s", __func__, p, strerror (errno));
+        return NULL;
+    }
+
+    return stx;
+}
+
+static void
+sync_mask (struct watch *w);
+
+static void
+sync_budget (struct watch *w);
+
+/* Ends the IN_ONESHOT subscriptions that got the event (the kernel would
+ * remove the watch for all subscribers). */
+static void
+oneshot (struct watch *w, const struct inotify_event *event)
+{
+    struct sub *s, *next;
+
+    chain_for_each_safe (w->subs, s, next) {
+        if (!(s->mask & IN_ONESHOT) || s->skip || !(event->mask & s->mask & IN_ALL_EVENTS))
+            continue;
+
+        /* nothing but IN_IGNORED from now on */
+        s->mask &= ~IN_ALL_EVENTS;
+        if (w->dead)
+            continue;
+
+        if (w->subs == s && s->next == NULL) {
+            if (watch_remove (w) == -1)
+                WARNING ("inotify_rm_watch (%d): %s", w->wd, strerror (errno));
+            continue;
+        }
+
+        struct client *c = s->c;
+        int prio = OUT_HIGH + s->prio;
+
+        sub_free (w, s);
+        sync_mask (w);
+        sync_budget (w);
+        control_ignored (c, w->wd, prio);
+    }
+}
+
+/* Handles an event read from inotify. */
+static void
+handle_event (struct inotify_event *event)
+{
+    struct watch *w = watch_get (event->wd);
+    struct statx stx;
+
+    if (w != NULL && w->budget)
+        budget_touch (w->budget);
+    if (w != NULL)
+        checkpoint_touch (w);
+
+    /* pending summaries precede IN_IGNORED (the wd is gone after it) */
+    if (w != NULL && (event->mask & IN_IGNORED)) {
+        struct sub *s;
+
+        chain_for_each (w->subs, s) {
+            if (s->rate)
+                rate_free (s->rate);
+            s->rate = NULL;
+        }
+    }
+
+    if (w == NULL) {
+        control_notify (OUT_NORMAL, event->wd, event->mask, event->cookie,
+                        event->name, event->len, NULL);
+    } else if (!suppress (w, event)) {
+        control_notify (OUT_NORMAL, event->wd, event->mask, event->cookie,
+                        event->name, event->len, event_stat (w, event, &stx));
+        oneshot (w, event);
+    }
+
+    /* the watch was removed (explicitly or by the kernel) */
+    if (w != NULL && (event->mask & IN_IGNORED))
+        watch_forget (w);
+}
+
+/* Keeps a copy of the event until watch_release (). */
+static void
+hold (const struct inotify_event *event)
+{
+    size_t sz = sizeof (*event) + event->len;
+    struct held *h = malloc (sizeof (*h) + sz);
+    assert (h != NULL);
+
+    memcpy (h->data, event, sz);
+    chain_add_tail (held, h);
+}
+
+/**
+ * Handles the held events of watches tracked meanwhile, and all of them once
+ * no crawl is running (with no watch to attribute them to).
+ */
+void
+watch_release (void)
+{
+    struct held *h, *next;
+    int all = !crawl_running ();
+
+    chain_for_each_safe (held, h, next) {
+        struct inotify_event *event = (void *) h->data;
+
+        if (!all && watch_get (event->wd) == NULL)
+            continue;
+
+        chain_del (held, h);
+        handle_event (event);
+        free (h);
+    }
+}
 
 static void
 watch_handler (struct evl_handler *eh, uint32_t _events, void *_nil)
 {
     unsigned int sz = 0;
 
+    if (paused)
+        return;
+
+    if (held != NULL)
+        watch_release ();
+
     if (ioctl (eh->fd, FIONREAD, &sz) == -1) {
         ERR ("ioctl (FIONREAD): %s", strerror (errno));
         return;
@@ -56,7 +389,12 @@ watch_handler (struct evl_handler *eh, uint32_t _events, void *_nil)
             ERR ("%s: File was ignored", __func__);
         }*/
 
-        control_notify (event->wd, event->mask, event->cookie, event->name, event->len);
+        /* a directory of a running crawl may not be tracked yet: its
+         * events wait until it is (see watch_release ()) */
+        if (watch_get (event->wd) == NULL && crawl_running ())
+            hold (event);
+        else
+            handle_event (event);
 
         event = (void *) event + sizeof (*event) + event->len;
     }
@@ -64,12 +402,17 @@ watch_handler (struct evl_handler *eh, uint32_t _events, void *_nil)
     free (buf);
 }
 
+/**
+ * Starts reading inotify instance @a ifd (e.g. received on handover), or a
+ * new one if @a ifd is -1.
+ */
 int
-watch_init (struct evl_inst *loop)
+watch_init (struct evl_inst *loop, int ifd)
 {
     assert (eh == NULL);
 
-    int ifd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+    if (ifd == -1)
+        ifd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
     if (ifd == -1) {
         ERR ("inotify_init1: %s", strerror (errno));
         return -1;
@@ -77,6 +420,7 @@ watch_init (struct evl_inst *loop)
 
     eh = evl_add (loop, ifd, EPOLLIN, &watch_handler, NULL);
     assert (eh != NULL);
+    eloop = loop;
 
     return 0;
 }
@@ -91,12 +435,186 @@ watch_destroy (struct evl_inst *loop)
     }
 }
 
+/**
+ * Stops (or resumes) reading events, so they queue up in the kernel.
+ */
+void
+watch_pause (int on)
+{
+    assert (eh != NULL);
+
+    DEBUG ("%s: %s", __func__, on ? "paused" : "resumed");
+    evl_mod (eloop, eh, on ? 0 : EPOLLIN);
+    paused = on;
+}
+
+unsigned int
+watch_count (void)
+{
+    return nwatches;
+}
+
+int
+watch_fd (void)
+{
+    assert (eh != NULL);
+
+    return eh->fd;
+}
+
+/* Finds subscription of the client @a c. */
+struct sub *
+watch_sub (const struct watch *w, const struct client *c)
+{
+    struct sub *s;
+
+    chain_for_each (w->subs, s) {
+        if (s->c == c)
+            return s;
+    }
+
+    return NULL;
+}
+
+/* Sets the kernel mask of the watch to the union of the subscriber masks.
+ * IN_ONESHOT is handled per subscription, IN_EXCL_UNLINK is set only if all
+ * subscribers asked for it. */
+static void
+sync_mask (struct watch *w)
+{
+    uint32_t mask = 0, excl = IN_EXCL_UNLINK;
+    struct sub *s;
+
+    chain_for_each (w->subs, s) {
+        mask |= s->mask;
+        excl &= s->mask;
+    }
+    mask = (mask & ~WATCH_SUB_FLAGS) | excl;
+
+    if (mask == 0 || mask == w->mask || w->dead)
+        return;
+
+    int wd = inotify_add_watch (eh->fd, w->path, mask);
+    if (wd == w->wd) {
+        w->mask = mask;
+        return;
+    }
+
+    /* the path was renamed or replaced meanwhile */
+    if (wd == -1) {
+        WARNING ("inotify_add_watch (%s): %s", w->path, strerror (errno));
+    } else {
+        WARNING ("%s: %s is no longer watch %d", __func__, w->path, w->wd);
+        struct watch *other = watch_get (wd);
+        if (other != NULL)
+            other->mask = mask;
+        else
+            inotify_rm_watch (eh->fd, wd);
+    }
+}
+
+/**
+ * Subscribes the client @a c to events of the watch matching @a mask
+ * (IN_MASK_ADD extends the previous subscription) and updates the kernel
+ * mask.
+ */
+void
+watch_subscribe (struct watch *w, struct client *c, uint32_t mask)
+{
+    struct sub *s = watch_sub (w, c);
+
+    if (s == NULL) {
+        s = calloc (1, sizeof (*s));
+        assert (s != NULL);
+        s->c    = c;
+        s->prio = WATCH_PRIO_NORMAL;
+        chain_add (w->subs, s);
+    }
+
+    s->mask = (mask & IN_MASK_ADD) ? (s->mask | mask) : mask;
+    s->mask &= ~IN_MASK_ADD;
+
+    sync_mask (w);
+    /* a new subscriber does not allow eviction until it says so */
+    sync_budget (w);
+}
+
+/* A shared watch may be evicted only if all subscribers allow it, when idle
+ * for the longest of their ttls. */
+static void
+sync_budget (struct watch *w)
+{
+    int evictable = w->subs != NULL && !w->dead;
+    int idle = 1; /* all subscribers set a ttl */
+    unsigned int ttl = 0;
+    struct sub *s;
+
+    chain_for_each (w->subs, s) {
+        evictable &= s->evictable;
+        idle &= s->ttl != 0;
+        if (s->ttl > ttl)
+            ttl = s->ttl;
+    }
+    if (!idle)
+        ttl = 0;
+
+    if (w->budget && (!evictable || budget_ttl (w->budget) != ttl)) {
+        budget_free (w->budget);
+        w->budget = NULL;
+    }
+    if (evictable && w->budget == NULL)
+        w->budget = budget_new (w, ttl);
+}
+
+/* Applies add_watch options to the subscription (with IN_MASK_ADD only the
+ * given ones). */
+static void
+set_opts (struct watch *w, struct sub *s, uint32_t mask, const struct watch_opts *opts)
+{
+    if (!(mask & IN_MASK_ADD))
+        s->flags = 0;
+    if (opts != NULL) {
+        s->flags |= opts->flags;
+        s->prio = opts->prio;
+    }
+
+    if (s->rate && (opts == NULL || opts->rate || !(mask & IN_MASK_ADD))) {
+        rate_free (s->rate);
+        s->rate = NULL;
+    }
+    if (opts != NULL && opts->rate)
+        s->rate = rate_new (w, s, opts->rate, opts->burst, opts->names);
+
+    int evictable = opts != NULL && (opts->evictable || opts->ttl);
+    if (evictable || !(mask & IN_MASK_ADD)) {
+        s->evictable = evictable;
+        s->ttl       = evictable ? opts->ttl : 0;
+    }
+
+    sync_budget (w);
+}
+
+/**
+ * Adds (or modifies) a watch for the client @a c.  If another client watches
+ * the same inode, the watch is shared: the kernel mask is the union of the
+ * subscriber masks, while the options (and IN_ONESHOT) are per subscription.
+ *
+ * @return watch descriptor, or -1 with errno set on error
+ */
 int
-watch_add (const char *path, uint32_t mask)
+watch_add (const char *path, uint32_t mask, const struct watch_opts *opts,
+           struct client *c)
 {
     assert (eh != NULL);
 
-    int fd = inotify_add_watch (eh->fd, path, mask);
+    if (opts != NULL && (opts->flags & WATCH_F_POLL))
+        return poll_add (path, mask, opts, c);
+
+    /* keep events of other subscribers, the mask is narrowed below */
+    uint32_t kmask = (mask & ~WATCH_SUB_FLAGS) | IN_MASK_ADD;
+    int fd = inotify_add_watch (eh->fd, path, kmask);
+    if (fd == -1 && errno == ENOSPC && budget_evict (1) == 1)
+        fd = inotify_add_watch (eh->fd, path, kmask);
     if (fd == -1) {
         int tmp = errno;
         ERR ("inotify_add_watch: %s", strerror (errno));
@@ -104,13 +622,133 @@ watch_add (const char *path, uint32_t mask)
         return -1;
     }
 
+    int added = watch_get (fd) == NULL;
+    struct watch *w = watch_track (fd, path, kmask);
+    watch_subscribe (w, c, mask);
+    set_opts (w, watch_sub (w, c), mask, opts);
+    checkpoint_add (w);
+
+    /* only a new watch takes from the budget */
+    if (added)
+        budget_check (w);
+
     return fd;
 }
 
+/* Fills options the subscription would be added with. */
+void
+watch_get_opts (const struct sub *s, struct watch_opts *opts)
+{
+    memset (opts, 0, sizeof (*opts));
+    opts->flags     = s->flags;
+    opts->prio      = s->prio;
+    if (s->rate)
+        rate_params (s->rate, &opts->rate, &opts->burst, &opts->names);
+    opts->evictable = s->evictable;
+    opts->ttl       = s->ttl;
+}
+
+/**
+ * Records the watch @a wd of an inotify instance taken over from another
+ * port (see handover.c).
+ */
+struct watch *
+watch_restore (int wd, const char *path, uint32_t mask, const struct watch_opts *opts,
+               struct client *c)
+{
+    struct watch *w = watch_track (wd, path, mask);
+
+    watch_subscribe (w, c, mask);
+    set_opts (w, watch_sub (w, c), mask, opts);
+    checkpoint_add (w);
+
+    return w;
+}
+
+/* Calls @a fn for every watch that has not been removed. */
+void
+watch_for_each (watch_fn *fn, void *arg)
+{
+    for (unsigned int i = 0; i < nbuckets; i++) {
+        struct watch *w;
+
+        chain_for_each (table[i], w) {
+            if (!w->dead)
+                fn (w, arg);
+        }
+    }
+}
+
+/**
+ * Removes the watch from inotify for all subscribers, they get IN_IGNORED
+ * when it arrives.
+ */
 int
-watch_rm (int wfd)
+watch_remove (struct watch *w)
+{
+    assert (eh != NULL && !w->dead);
+
+    if (w->budget) {
+        budget_free (w->budget);
+        w->budget = NULL;
+    }
+    w->dead = 1;
+    nwatches--;
+
+    return inotify_rm_watch (eh->fd, w->wd);
+}
+
+/**
+ * Unsubscribes the client @a c from the watch.  The watch is removed from
+ * inotify when the last subscriber is gone.
+ */
+int
+watch_rm (int wfd, struct client *c)
 {
     assert (eh != NULL);
 
-    return inotify_rm_watch (eh->fd, wfd);
+    /* poll mode watches have negative descriptors */
+    if (wfd < 0)
+        return poll_rm (wfd, c);
+
+    struct watch *w = watch_get (wfd);
+    if (w == NULL || w->dead)
+        return inotify_rm_watch (eh->fd, wfd);
+
+    struct sub *s = watch_sub (w, c);
+    if (s == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (w->subs == s && s->next == NULL)
+        return watch_remove (w);
+
+    sub_free (w, s);
+    sync_mask (w);
+    sync_budget (w);
+
+    return 0;
+}
+
+/* Drops all subscriptions of the client (it is gone). */
+void
+watch_drop_client (struct client *c)
+{
+    for (unsigned int i = 0; i < nbuckets; i++) {
+        struct watch *w;
+
+        chain_for_each (table[i], w) {
+            struct sub *s = watch_sub (w, c);
+            if (s == NULL)
+                continue;
+
+            sub_free (w, s);
+            if (w->subs != NULL) {
+                sync_mask (w);
+                sync_budget (w);
+            } else if (!w->dead && watch_remove (w) == -1)
+                WARNING ("inotify_rm_watch (%d): %s", w->wd, strerror (errno));
+        }
+    }
 }
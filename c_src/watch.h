@@ -1,18 +1,141 @@
 #ifndef _WATCH_H
 #define _WATCH_H
 
+#include <time.h>
+
 #include "evl.h"
 
+struct budget;
+struct client;
+struct rate;
+
+/* watch flags */
+#define WATCH_F_HASH (1 << 0) /* suppress IN_CLOSE_WRITE if content unchanged */
+#define WATCH_F_STAT (1 << 1) /* attach statx() result to events */
+#define WATCH_F_POLL (1 << 2) /* poll instead of inotify (see poll.c) */
+
+/* priority classes (map to output classes) */
+enum {
+    WATCH_PRIO_HIGH = 0,
+    WATCH_PRIO_NORMAL,
+    WATCH_PRIO_LOW,
+    WATCH_NPRIO
+};
+
+/* per watch options passed with add_watch command */
+struct watch_opts {
+    unsigned int flags;
+    int          prio;
+    /* rate limit: events per second (0 - unlimited), burst size and
+     * maximum number of names in summaries */
+    unsigned int rate;
+    unsigned int burst;
+    unsigned int names;
+    /* may be evicted when the watch budget is exhausted; idle watches
+     * are removed after `ttl' seconds (0 - never) */
+    int          evictable;
+    unsigned int ttl;
+    /* minimum poll interval of poll mode watches (milliseconds, 0 - default) */
+    unsigned int poll_ms;
+    /* send the directory entries after adding the watch (see snapshot.c) */
+    int          snapshot;
+};
+
+/* inotify flags kept per subscription rather than set in the kernel (see
+ * watch_add()) */
+#define WATCH_SUB_FLAGS (IN_ONESHOT | IN_EXCL_UNLINK)
+
+/* client subscribed to a watch (identical watches of clients are shared,
+ * the options are per subscription) */
+struct sub {
+    struct sub    *prev;
+    struct sub    *next;
+    struct client *c;
+    uint32_t      mask;
+    unsigned int  flags;
+    int           prio;
+    struct rate   *rate;
+    int           evictable;
+    unsigned int  ttl;
+    /* the event being dispatched is not delivered (see watch_handler()) */
+    int           skip;
+};
+
+struct watch {
+    /* hash bucket chain */
+    struct watch  *prev;
+    struct watch  *next;
+    int           wd;
+    /* union of the subscriber masks set in the kernel */
+    uint32_t      mask;
+    struct sub    *subs;
+    /* removed from inotify, waiting for IN_IGNORED */
+    int           dead;
+    /* set while all subscribers allow eviction */
+    struct budget *budget;
+    /* mtime of the path in the checkpoint, events since (see checkpoint.c) */
+    struct timespec mtime;
+    int           dirty;
+    char          *path;
+};
+
+/* watch_for_each() callback prototype */
+typedef void (watch_fn) (struct watch *w, void *arg);
+
 extern int
-watch_init (struct evl_inst *loop);
+watch_init (struct evl_inst *loop, int ifd);
 
 extern void
 watch_destroy (struct evl_inst *loop);
 
 extern int
-watch_add (const char *path, uint32_t mask);
+watch_fd (void);
+
+extern void
+watch_pause (int on);
+
+extern int
+watch_add (const char *path, uint32_t mask, const struct watch_opts *opts,
+           struct client *c);
+
+extern int
+watch_rm (int wfd, struct client *c);
 
 extern int
-watch_rm (int wfd);
+watch_remove (struct watch *w);
+
+extern struct sub *
+watch_sub (const struct watch *w, const struct client *c);
+
+extern void
+watch_subscribe (struct watch *w, struct client *c, uint32_t mask);
+
+extern void
+watch_drop_client (struct client *c);
+
+extern void
+watch_get_opts (const struct sub *s, struct watch_opts *opts);
+
+extern struct watch *
+watch_restore (int wd, const char *path, uint32_t mask, const struct watch_opts *opts,
+               struct client *c);
+
+extern void
+watch_for_each (watch_fn *fn, void *arg);
+
+extern struct watch *
+watch_get (int wd);
+
+extern struct watch *
+watch_track (int wd, const char *path, uint32_t mask);
+
+extern void
+watch_forget (struct watch *w);
+
+extern void
+watch_release (void);
+
+extern unsigned int
+watch_count (void);
 
 #endif /* _WATCH_H */
@@ -2,8 +2,17 @@
 
 %% API
 -export ([ new/0
+         , new/1
          , add_watch/3
+         , add_watch/4
+         , add_tree/3
          , rm_watch/2
+         , stats/1
+         , set_opt/3
+         , active/2
+         , replay/2
+         , set_owner/2
+         , upgrade/1
          , close/1
          ]).
 
@@ -17,14 +26,48 @@
          ]).
 
 -record (s, { owner
+            , persistent
+            , daemon
+            , args
             , port
+              %% the port is restarted from its checkpoint when it exits
+            , checkpoint = false
+            , started
             , queue
+              %% port being replaced by upgrade/1, data of the new port held
+              %% until it exits and the caller waiting for that
+            , old
+            , held = []
+            , upgrading
+              %% requests made while waiting for the handover
+            , pending
             }).
 
 -include ("einotify.hrl").
 
 -define (cmd_add_watch, 0).
 -define (cmd_rm_watch,  1).
+-define (cmd_add_tree,  2).
+-define (cmd_stats,     3).
+-define (cmd_set_opt,   4).
+-define (cmd_replay,    5).
+-define (cmd_active,    6).
+-define (cmd_handover,  7).
+
+-define (opt_hash, 0).
+-define (opt_stat, 1).
+-define (opt_priority, 2).
+-define (opt_rate, 3).
+-define (opt_burst, 4).
+-define (opt_summary_names, 5).
+-define (opt_evictable, 6).
+-define (opt_ttl, 7).
+-define (opt_poll, 8).
+-define (opt_poll_interval, 9).
+-define (opt_snapshot, 10).
+
+%% a port exiting sooner after its start is not restarted (milliseconds)
+-define (restart_min, 1000).
 
 -define (
     dbg (F, A),
@@ -38,15 +81,80 @@
                 move_self | close | move | onlydir | dont_follow | excl_unlink |
                 mask_add | oneshot | all_events.
 
+-type option() :: hash | {hash, boolean()} | stat | {stat, boolean()} |
+                  {priority, high | normal | low} |
+                  {rate, pos_integer()} | {burst, pos_integer()} |
+                  {summary_names, non_neg_integer()} |
+                  evictable | {evictable, boolean()} | {ttl, pos_integer()} |
+                  poll | {poll, boolean()} | {poll_interval, pos_integer()} |
+                  snapshot.
+
 
 %%==============================================================================
 %% API
 %%==============================================================================
 
+-type port_option() :: {engine, epoll | uring} | {name, atom()} |
+                       persistent | {persistent, boolean()} |
+                       {daemon, file:filename()} | {checkpoint, file:filename()} |
+                       {active, true | non_neg_integer()} | tunable().
+
+-type tunable() :: {batch, pos_integer()} | {rbuf, pos_integer()} |
+                   {sbuf, pos_integer()} | {write_max, pos_integer()} |
+                   {coalesce, non_neg_integer()} | {log_level, log_level()} |
+                   {watch_budget, non_neg_integer()} | {history, non_neg_integer()}.
+
+-type log_level() :: emerg | alert | crit | err | warning | notice | info | debug.
+
 -spec new () -> {ok, Pid :: pid()}.
 %% Starts inotify instance. Returns a pid to be used in subsequent calls.
 new () ->
-    gen_server:start_link (?MODULE, self (), []).
+    new ([]).
+
+-spec new (Opts :: [port_option()]) -> {ok, Pid :: pid()}.
+%% Starts inotify instance with options:
+%%   {name, Name} - register the instance locally;
+%%   persistent - do not link to the caller and keep running when the owner
+%%     exits, so a restarted owner can take over with set_owner/2 and catch
+%%     up with replay/2;
+%%   {daemon, Path} - connect to a port running in daemon mode (einotify -d
+%%     Path) instead of spawning one. The daemon shares identical watches of
+%%     its clients and sends each client only the events it watches for,
+%%     as its own watch options (and oneshot) say. Only the write_max,
+%%     coalesce and active tunables apply to a client (others make the start
+%%     fail with badarg and set_opt/3 return {error, badarg}), the rest is
+%%     set on the daemon command line;
+%%   {checkpoint, File} - keep the watch set in File (not with daemon). A
+%%     port started with an existing checkpoint re-adds the watches, and an
+%%     exited port is restarted, failing the requests in progress. The owner
+%%     gets #einotify_restored{} chunks after every start telling which
+%%     watched paths changed while no port was running; poll watches are not
+%%     checkpointed;
+%%   {engine, E} - event loop engine (default from the application
+%%     environment, epoll); io_uring falls back to epoll if unsupported;
+%%   {batch, N} - events handled per loop iteration (default 10);
+%%   {rbuf, N}, {sbuf, N} - command and event buffer sizes (default 2048);
+%%   {write_max, N} - maximum bytes per write to the pipe (default 65536);
+%%   {coalesce, N} - low priority backlog to start coalescing (default 65536);
+%%   {log_level, L} - syslog level of the port (default info);
+%%   {watch_budget, N} - maximum number of watches of the port before
+%%     evictable ones are removed (default 0, fs.inotify.max_user_watches,
+%%     which also counts watches of other processes of the user; evictable
+%%     watches are removed when the kernel limit is hit as well);
+%%   {history, N} - size of the event history for replay/2 in bytes
+%%     (default 1048576, 0 disables it);
+%%   {active, A} - initial event credits (default true), see active/2; with
+%%     0 the owner gets {einotify_passive, Pid} at once.
+new (Opts) ->
+    Args = {self (), Opts},
+    Start = case proplists:get_bool (persistent, Opts) of
+                true  -> start;
+                false -> start_link
+            end,
+    case proplists:get_value (name, Opts) of
+        undefined -> gen_server:Start (?MODULE, Args, []);
+        Name      -> gen_server:Start ({local, Name}, ?MODULE, Args, [])
+    end.
 
 -spec add_watch (Pid :: pid(), Filename :: string(), Flags :: integer() | [flag()]) ->
         {ok, Fd :: integer()} | {error, Code :: integer()}.
@@ -57,11 +165,112 @@ add_watch (Pid, Filename, Mask) when is_integer (Mask) ->
 add_watch (Pid, Filename, Flags) ->
     call (Pid, {request, {?cmd_add_watch, {Filename, flags (Flags)}}}).
 
+-spec add_watch (Pid :: pid(), Filename :: string(), Flags :: integer() | [flag()],
+                 Opts :: [option()]) ->
+        {ok, Fd :: integer()} | {error, Code :: integer()}.
+%% Adds or modifies a watch for the file or directory with port side options:
+%%   hash - suppress close_write events for files whose content is unchanged
+%%     (files above 4 MiB are not hashed);
+%%   stat - attach #einotify_stat{} of the affected path to events;
+%%   {priority, P} - output class of the events (default normal). When the
+%%     output is backlogged high priority events are written first and
+%%     repeated low priority events are coalesced;
+%%   {rate, R}, {burst, B} - token bucket rate limit (events per second,
+%%     bucket size, default R). Above the limit events are replaced by one
+%%     #einotify_summary{} per second until the rate drops;
+%%   {summary_names, N} - maximum number of names in a summary (default 16);
+%%   evictable - the watch may be removed when the watch budget is exhausted
+%%     (least recently active first). The owner gets #einotify_evicted{};
+%%   {ttl, S} - evictable, and removed after S seconds without events;
+%%   poll - poll the path instead of using inotify (for NFS, FUSE and other
+%%     file systems without inotify support). Poll watches have negative
+%%     descriptors; renames are reported as delete and create, content
+%%     changes as modify and close_write. Not combinable with hash, rate and
+%%     evictable/ttl ({error, 22}, EINVAL);
+%%   {poll_interval, Ms} - minimum poll interval (default 1000). The interval
+%%     doubles while nothing changes, up to 60 seconds;
+%%   snapshot - after the reply send the current directory entries as
+%%     #einotify_snapshot{} chunks, before any event of the new watch.
+add_watch (Pid, Filename, Mask, Opts) when is_integer (Mask) ->
+    call (Pid, {request, {?cmd_add_watch, {Filename, Mask, options (Opts)}}});
+
+add_watch (Pid, Filename, Flags, Opts) ->
+    add_watch (Pid, Filename, flags (Flags), Opts).
+
+-spec add_tree (Pid :: pid(), Dirname :: string(), Flags :: integer() | [flag()]) ->
+        {ok, Id :: integer()} | {error, Code :: integer()}.
+%% Adds watches for the directory and all its subdirectories. The tree is
+%% crawled in parallel inside the port; watch descriptors are sent to the owner
+%% in #einotify_crawl{} chunks followed by #einotify_crawl_done{}.
+add_tree (Pid, Dirname, Mask) when is_integer (Mask) ->
+    call (Pid, {request, {?cmd_add_tree, {Dirname, Mask}}});
+
+add_tree (Pid, Dirname, Flags) ->
+    call (Pid, {request, {?cmd_add_tree, {Dirname, flags (Flags)}}}).
+
 -spec rm_watch (Pid :: pid(), Fd :: integer()) -> ok | {error, Code :: integer()}.
 %% Removes a watch for the file or directory.
 rm_watch (Pid, Fd) ->
     call (Pid, {request, {?cmd_rm_watch, Fd}}).
 
+-spec stats (Pid :: pid()) -> {ok, [{atom(), integer()}]}.
+%% Returns port counters.
+stats (Pid) ->
+    call (Pid, {request, {?cmd_stats, []}}).
+
+-spec set_opt (Pid :: pid(), Key :: atom(), Value :: term()) ->
+        ok | {error, badarg}.
+%% Changes a port tunable at runtime (see new/1). Credits are granted with
+%% active/2 only.
+set_opt (_Pid, active, _Value) ->
+    {error, badarg};
+set_opt (Pid, Key, Value) ->
+    case tunable ({Key, Value}) of
+        badarg  -> {error, badarg};
+        Tunable -> call (Pid, {request, {?cmd_set_opt, Tunable}})
+    end.
+
+-spec active (Pid :: pid() | atom(), Active :: true | non_neg_integer()) -> ok.
+%% Flow control like inet {active, N}: with true all events are sent, with N
+%% the owner gets N more event messages after which it receives
+%% {einotify_passive, Pid} and further events are held back by the port.
+%% While the owner is passive and the backlog grows the port stops reading
+%% inotify, so events queue up in the kernel (and may overflow there). A
+%% daemon client that falls behind loses its backlog instead and gets an
+%% ?IN_Q_OVERFLOW event (wd -1); it may catch up with replay/2.
+active (Pid, Active) when Active =:= true; is_integer (Active), Active >= 0 ->
+    call (Pid, {request, {?cmd_active, Active}}).
+
+-spec replay (Pid :: pid() | atom(), Seq :: non_neg_integer()) ->
+        {ok, Last :: non_neg_integer()} |
+        {error, {out_of_window, Oldest :: pos_integer()}}.
+%% Resends recorded events with sequence numbers above Seq (the seq field of
+%% the last #einotify{} processed, 0 for all) to the owner. Last is the
+%% sequence number of the latest event; events already in the owner's
+%% mailbox may be received twice. If events after Seq are no longer recorded
+%% the owner has to rescan; Oldest is the first event still available.
+replay (Pid, Seq) ->
+    call (Pid, {request, {?cmd_replay, Seq}}).
+
+-spec set_owner (Pid :: pid() | atom(), Owner :: pid()) -> ok.
+%% Makes Owner the receiver of events.
+set_owner (Pid, Owner) ->
+    call (Pid, {set_owner, Owner}).
+
+-spec upgrade (Pid :: pid() | atom()) -> ok | {error, Reason :: term()}.
+%% Replaces the port with a new instance of the port executable (e.g. after
+%% a code upgrade) without re-adding watches: the old port hands the inotify
+%% instance and the watch table over to the new one, which continues reading
+%% the same kernel queue, so no events are lost. Events and replies of the
+%% new port are delivered after the old port has written out the rest, and
+%% ok is returned once it exited. If the new port exits first the old one
+%% stays in use and {error, {port_closed, Status}} is returned. The event
+%% history and poll mode watches are not carried over. Not available in
+%% daemon mode; {error, 16} (EBUSY) while add_tree/3 crawls are running,
+%% which in turn fail with EBUSY once the upgrade started.
+upgrade (Pid) ->
+    call (Pid, upgrade).
+
 -spec close (Pid :: pid()) -> ok.
 %% Stops inotify instance.
 close (Pid) ->
@@ -72,23 +281,51 @@ close (Pid) ->
 %% gen_server callbacks
 %%==============================================================================
 
-init (Owner) ->
+init ({Owner, PortOpts}) ->
     monitor (process, Owner),
-    Opts = [ {packet, 2}
-           , exit_status
-           , use_stdio
-           , binary
-           , {parallelism, true}
-           ],
-    Port = open_port ({spawn_executable, port ()}, Opts),
-    {ok, #s{ owner = Owner
-           , port  = Port
-           , queue = queue:new ()
-           }}.
+    Persistent = proplists:get_bool (persistent, PortOpts),
+    Checkpoint = proplists:is_defined (checkpoint, PortOpts),
+    case proplists:get_value (daemon, PortOpts) of
+        undefined ->
+            Args = port_args (PortOpts),
+            {ok, #s{ owner      = Owner
+                   , persistent = Persistent
+                   , daemon     = false
+                   , args       = Args
+                   , port       = spawn_port (Args)
+                   , checkpoint = Checkpoint
+                   , started    = erlang:monotonic_time (millisecond)
+                   , queue      = queue:new ()
+                   }};
+        _Path when Checkpoint ->
+            {stop, badarg};
+        Path ->
+            case [K || {K, _} <- tunables (PortOpts),
+                       not lists:member (K, [write_max, coalesce, active])] of
+                [] -> connect (Owner, Persistent, Path, PortOpts);
+                _  -> {stop, badarg}
+            end
+    end.
+
+handle_call ({request, Req}, From, #s{pending = P} = State) when is_list (P) ->
+    {noreply, State#s{pending = [{From, Req} | P]}};
+
+handle_call ({request, Req}, From, State) ->
+    {noreply, request (From, Req, State)};
+
+handle_call (upgrade, From, #s{daemon = false, old = undefined, pending = undefined,
+                               queue = Q} = State) ->
+    Sock = lists:flatten (io_lib:format ("@einotify-~s-~w",
+                                         [os:getpid (), erlang:unique_integer ([positive])])),
+    command (State, {?cmd_handover, Sock}),
+    {noreply, State#s{queue = queue:in ({upgrade, From, Sock}, Q), pending = []}};
 
-handle_call ({request, Req}, From, #s{port = P, queue = Q} = State) ->
-    port_command (P, term_to_binary (Req)),
-    {noreply, State#s{queue = queue:in (From, Q)}};
+handle_call (upgrade, _From, State) ->
+    {reply, {error, badarg}, State};
+
+handle_call ({set_owner, Owner}, _From, State) ->
+    monitor (process, Owner),
+    {reply, ok, State#s{owner = Owner}};
 
 handle_call (stop, _From, State) ->
     {stop, normal, ok, State};
@@ -99,29 +336,69 @@ handle_call (_Request, _From, State) ->
 handle_cast (_Msg, State) ->
     {noreply, State}.
 
-handle_info ({P, {data, Data}}, #s{owner = Owner, port = P, queue = Q} = State) ->
-    Msg = binary_to_term (Data),
-    case Msg of
-        #einotify{} ->
-            Owner ! Msg,
-            {noreply, State};
-        _ -> % this is reply to the command
-            {{value, Client}, Q2} = queue:out (Q),
-            gen_server:reply (Client, Msg),
-            {noreply, State#s{queue = Q2}}
+handle_info ({P, {data, Data}}, #s{old = P} = State) ->
+    handle_data (Data, State);
+
+handle_info ({P, {data, Data}}, #s{port = P, old = Old, held = H} = State)
+  when Old =/= undefined ->
+    {noreply, State#s{held = [Data | H]}};
+
+handle_info ({P, {data, Data}}, #s{port = P} = State) ->
+    handle_data (Data, State);
+
+%% The old port handed the instance over and exited.
+handle_info ({P, {exit_status, S}}, #s{old = P, held = H, upgrading = From} = State) ->
+    gen_server:reply (From, case S of
+                                0 -> ok;
+                                _ -> {error, {port_closed, S}}
+                            end),
+    {noreply, State2} = handle_held (lists:reverse (H),
+                                     State#s{old = undefined, held = [], upgrading = undefined}),
+    {noreply, send_pending (State2)};
+
+%% The new port exited before taking over: keep the old one.
+handle_info ({P, {exit_status, S}}, #s{port = P, old = Old, upgrading = From,
+                                     queue = Q} = State) when Old =/= undefined ->
+    ?dbg ("new port exited (~p), cancelling upgrade", [S]),
+    State2 = State#s{port = Old, old = undefined, held = [], upgrading = undefined},
+    command (State2, {?cmd_handover, ""}),
+    {noreply, State2#s{queue = queue:in ({cancel, From, S}, Q)}};
+
+handle_info ({tcp, S, Data}, #s{port = S} = State) ->
+    handle_data (Data, State);
+
+handle_info ({tcp_closed, S}, #s{port = S} = State) ->
+    {stop, daemon_closed, State};
+
+handle_info ({P, {exit_status, S}}, #s{port = P, old = undefined, checkpoint = true,
+                                     started = T} = State) ->
+    case erlang:monotonic_time (millisecond) - T < ?restart_min of
+        true  -> {stop, {port_closed, S}, State};
+        false -> {noreply, restart (State)}
     end;
 
 handle_info ({P, {exit_status, S}}, #s{port = P} = State) ->
     {stop, {port_closed, S}, State};
 
+handle_info ({'DOWN', _Ref, process, Owner, _Reason},
+             #s{owner = Owner, persistent = true} = State) ->
+    {noreply, State#s{owner = undefined}};
+
 handle_info ({'DOWN', _Ref, process, Owner, _Reason}, #s{owner = Owner} = State) ->
     {stop, normal, State};
 
+handle_info ({'DOWN', _Ref, process, _Pid, _Reason}, State) -> % previous owner
+    {noreply, State};
+
 handle_info (_Info, State) ->
     ?dbg ("unhandled info: ~p", [_Info]),
     {noreply, State}.
 
-terminate (_Reason, #s{port = P} = _State) ->
+terminate (_Reason, #s{daemon = true, port = S} = _State) ->
+    gen_tcp:close (S);
+
+terminate (_Reason, #s{port = P, old = Old} = _State) ->
+    Old =:= undefined orelse (catch port_close (Old)),
     port_close (P).
 
 code_change (_OldVsn, State, _Extra) ->
@@ -132,6 +409,131 @@ code_change (_OldVsn, State, _Extra) ->
 %% Internal functions
 %%==============================================================================
 
+handle_data (Data, #s{owner = Owner, queue = Q} = State) ->
+    Msg = binary_to_term (Data),
+    case Msg of
+        #einotify{} ->
+            forward (Owner, Msg),
+            {noreply, State};
+        #einotify_crawl{} ->
+            forward (Owner, Msg),
+            {noreply, State};
+        #einotify_crawl_done{} ->
+            forward (Owner, Msg),
+            {noreply, State};
+        #einotify_summary{} ->
+            forward (Owner, Msg),
+            {noreply, State};
+        #einotify_evicted{} ->
+            forward (Owner, Msg),
+            {noreply, State};
+        #einotify_snapshot{} ->
+            forward (Owner, Msg),
+            {noreply, State};
+        #einotify_restored{} ->
+            forward (Owner, Msg),
+            {noreply, State};
+        einotify_passive ->
+            forward (Owner, {einotify_passive, self ()}),
+            {noreply, State};
+        _ -> % this is reply to the command
+            {{value, Client}, Q2} = queue:out (Q),
+            {noreply, reply (Client, Msg, State#s{queue = Q2})}
+    end.
+
+handle_held ([Data | T], State) ->
+    {noreply, State2} = handle_data (Data, State),
+    handle_held (T, State2);
+handle_held ([], State) ->
+    {noreply, State}.
+
+%% Replies to set_opt commands sent on connect to the daemon are dropped.
+reply (none, _Msg, State) ->
+    State;
+%% The old port is ready for handover: start the new one, the caller and the
+%% requests made meanwhile wait until the old port exits.
+reply ({upgrade, From, Sock}, ok, #s{port = P, args = Args} = State) ->
+    State#s{port = spawn_port (Args ++ ["-H", Sock]), old = P, upgrading = From};
+reply ({upgrade, From, _Sock}, Msg, State) ->
+    gen_server:reply (From, Msg),
+    send_pending (State);
+%% The old port stopped waiting for the failed new one.
+reply ({cancel, From, S}, _Msg, State) ->
+    gen_server:reply (From, {error, {port_closed, S}}),
+    send_pending (State);
+reply (Client, Msg, State) ->
+    gen_server:reply (Client, Msg),
+    State.
+
+%% Starts a new port after the previous one exited: it re-adds the watches
+%% from the checkpoint.  Requests sent to the old port fail, those made while
+%% waiting for a handover go to the new one.
+restart (#s{args = Args, queue = Q} = State) ->
+    ?dbg ("port exited, restarting"),
+    lists:foreach (fun fail/1, queue:to_list (Q)),
+    send_pending (State#s{ port    = spawn_port (Args)
+                         , started = erlang:monotonic_time (millisecond)
+                         , queue   = queue:new ()
+                         }).
+
+%% Sends the requests made while waiting for a handover.
+send_pending (#s{pending = undefined} = State) ->
+    State;
+send_pending (#s{pending = Pending} = State) ->
+    lists:foldl (fun ({Client, Req}, S) -> request (Client, Req, S) end,
+                 State#s{pending = undefined}, lists:reverse (Pending)).
+
+fail (none) ->
+    ok;
+fail ({upgrade, From, _Sock}) ->
+    gen_server:reply (From, {error, port_closed});
+fail ({cancel, From, _S}) ->
+    gen_server:reply (From, {error, port_closed});
+fail (Client) ->
+    gen_server:reply (Client, {error, port_closed}).
+
+request (From, Req, #s{queue = Q} = State) ->
+    command (State, Req),
+    State#s{queue = queue:in (From, Q)}.
+
+spawn_port (Args) ->
+    Opts = [ {packet, 2}
+           , {args, Args}
+           , exit_status
+           , use_stdio
+           , binary
+           , {parallelism, true}
+           ],
+    open_port ({spawn_executable, port ()}, Opts).
+
+%% Connects to the daemon and applies the per client tunables.
+connect (Owner, Persistent, Path, PortOpts) ->
+    SockOpts = [binary, {packet, 2}, {active, true}],
+    case gen_tcp:connect ({local, Path}, 0, SockOpts) of
+        {ok, Sock} ->
+            State = #s{ owner      = Owner
+                      , persistent = Persistent
+                      , daemon     = true
+                      , port       = Sock
+                      , queue      = queue:new ()
+                      },
+            {ok, lists:foldl (fun set_tunable/2, State, tunables (PortOpts))};
+        {error, Reason} ->
+            {stop, Reason}
+    end.
+
+command (#s{daemon = true, port = S}, Req) ->
+    gen_tcp:send (S, term_to_binary (Req));
+command (#s{port = P}, Req) ->
+    port_command (P, term_to_binary (Req)).
+
+set_tunable ({active, N}, #s{queue = Q} = State) ->
+    command (State, {?cmd_active, N}),
+    State#s{queue = queue:in (none, Q)};
+set_tunable (Tunable, #s{queue = Q} = State) ->
+    command (State, {?cmd_set_opt, tunable (Tunable)}),
+    State#s{queue = queue:in (none, Q)}.
+
 app () ->
     case application:get_application (?MODULE) of
         {ok, App} -> App;
@@ -147,9 +549,66 @@ priv () ->
 port () ->
     filename:join (priv (), ?MODULE_STRING).
 
+%% Port command line from new/1 options and the application environment.
+port_args (Opts) ->
+    Engine = case proplists:get_value (engine, Opts) of
+                 undefined -> application:get_env (app (), engine, epoll);
+                 E         -> E
+             end,
+    EngineArgs = case Engine of
+                     uring -> ["-u"];
+                     epoll -> []
+                 end,
+    CheckpointArgs = case proplists:get_value (checkpoint, Opts) of
+                         undefined -> [];
+                         File      -> ["-k", File]
+                     end,
+    EngineArgs ++ CheckpointArgs
+        ++ lists:append ([tunable_arg (tunable (O)) || O <- tunables (Opts)]).
+
+tunables (Opts) ->
+    [O || {K, _} = O <- proplists:unfold (Opts),
+          not lists:member (K, [engine, name, persistent, daemon, checkpoint]),
+          O =/= {active, true}].
+
+tunable_arg ({Key, Value}) ->
+    [[$-, element (Key + 1, {$b, $r, $s, $w, $c, $l, $m, $h, $a})], integer_to_list (Value)].
+
+-spec tunable (tunable() | term()) -> {Key :: integer(), Value :: integer()} | badarg.
+tunable ({batch, N})     when is_integer (N) -> {0, N};
+tunable ({rbuf, N})      when is_integer (N) -> {1, N};
+tunable ({sbuf, N})      when is_integer (N) -> {2, N};
+tunable ({write_max, N}) when is_integer (N) -> {3, N};
+tunable ({coalesce, N})  when is_integer (N) -> {4, N};
+tunable ({log_level, L}) when is_atom (L) ->
+    case log_level (L) of
+        badarg -> badarg;
+        N      -> {5, N}
+    end;
+tunable ({watch_budget, N}) when is_integer (N) -> {6, N};
+tunable ({history, N})   when is_integer (N) -> {7, N};
+tunable ({active, N})    when is_integer (N) -> {8, N};
+tunable (_) -> badarg.
+
+log_level (emerg)   -> 0;
+log_level (alert)   -> 1;
+log_level (crit)    -> 2;
+log_level (err)     -> 3;
+log_level (warning) -> 4;
+log_level (notice)  -> 5;
+log_level (info)    -> 6;
+log_level (debug)   -> 7;
+log_level (_)       -> badarg.
+
 call (Pid, Msg) ->
     gen_server:call (Pid, Msg, infinity).
 
+%% Sends the message to the owner (dropped while a persistent instance has none).
+forward (undefined, _Msg) ->
+    ok;
+forward (Owner, Msg) ->
+    Owner ! Msg.
+
 %%------------------------------------------------------------------------------
 
 -spec flags (Flags :: [flag()]) -> Mask :: integer().
@@ -186,3 +645,30 @@ flag (isdir)         -> ?IN_ISDIR;
 flag (oneshot)       -> ?IN_ONESHOT;
 
 flag (all_events)    -> ?IN_ALL_EVENTS.
+
+%%------------------------------------------------------------------------------
+
+-spec options (Opts :: [option()]) -> [{integer(), integer()}].
+options (Opts) ->
+    [option (O) || O <- Opts].
+
+option (hash)         -> {?opt_hash, 1};
+option ({hash, Bool}) -> {?opt_hash, bool (Bool)};
+option (stat)         -> {?opt_stat, 1};
+option ({stat, Bool}) -> {?opt_stat, bool (Bool)};
+option ({priority, high})   -> {?opt_priority, 0};
+option ({priority, normal}) -> {?opt_priority, 1};
+option ({priority, low})    -> {?opt_priority, 2};
+option ({rate, R}) when is_integer (R), R > 0  -> {?opt_rate, R};
+option ({burst, B}) when is_integer (B), B > 0 -> {?opt_burst, B};
+option ({summary_names, N}) when is_integer (N), N >= 0 -> {?opt_summary_names, N};
+option (evictable)         -> {?opt_evictable, 1};
+option ({evictable, Bool}) -> {?opt_evictable, bool (Bool)};
+option ({ttl, S}) when is_integer (S), S > 0 -> {?opt_ttl, S};
+option (poll)         -> {?opt_poll, 1};
+option ({poll, Bool}) -> {?opt_poll, bool (Bool)};
+option ({poll_interval, Ms}) when is_integer (Ms), Ms > 0 -> {?opt_poll_interval, Ms};
+option (snapshot)     -> {?opt_snapshot, 1}.
+
+bool (true)  -> 1;
+bool (false) -> 0.
@@ -0,0 +1,558 @@
+-module (einotify_tests).
+
+%% Behaviour tests of the port through the einotify API.  They need the port
+%% executable in priv (make all) and inotify; run with make test.
+
+-include_lib ("eunit/include/eunit.hrl").
+-include ("einotify.hrl").
+
+%% how long to wait for a message that should arrive (milliseconds)
+-define (wait, 2000).
+%% how long to wait before deciding that no message comes
+-define (quiet, 300).
+
+
+%%==============================================================================
+%% Fixtures
+%%==============================================================================
+
+port_test_ () ->
+    { foreach
+    , fun setup/0
+    , fun cleanup/1
+    , [ fun add_tree/1
+      , fun add_tree_budget/1
+      , fun hash/1
+      , fun hash_two_watches/1
+      , fun stat/1
+      , fun uring/1
+      , fun priority/1
+      , fun rate/1
+      , fun tunables/1
+      , fun budget/1
+      , fun poll/1
+      , fun snapshot/1
+      , fun replay/1
+      , fun coalesce/1
+      , fun pipeline/1
+      , fun oversized/1
+      , fun credits/1
+      , fun upgrade/1
+      , fun checkpoint/1
+      , fun checkpoint_torn/1
+      ]
+    }.
+
+daemon_test_ () ->
+    { foreach
+    , fun daemon_setup/0
+    , fun daemon_cleanup/1
+    , [ fun daemon_share/1
+      , fun daemon_options/1
+      , fun daemon_overflow/1
+      ]
+    }.
+
+setup () ->
+    Dir = tmp_dir (),
+    ok = file:make_dir (Dir),
+    Dir.
+
+cleanup (Dir) ->
+    os:cmd ("rm -rf " ++ Dir).
+
+daemon_setup () ->
+    Dir = setup (),
+    Sock = filename:join (Dir, "sock"),
+    Daemon = open_port ({spawn_executable, port ()}, [{args, ["-d", Sock]}, exit_status]),
+    wait_for (Sock),
+    {Dir, Sock, Daemon}.
+
+daemon_cleanup ({Dir, _Sock, Daemon}) ->
+    {os_pid, Pid} = erlang:port_info (Daemon, os_pid),
+    os:cmd ("kill " ++ integer_to_list (Pid)),
+    receive {Daemon, {exit_status, _}} -> ok after ?wait -> ok end,
+    cleanup (Dir).
+
+
+%%==============================================================================
+%% Port tests
+%%==============================================================================
+
+%% Every directory of the tree gets a watch, reported in crawl chunks.
+add_tree (Dir) ->
+    ?_test (begin
+        A = subdir (Dir, "a"),
+        B = subdir (A, "b"),
+        C = subdir (B, "c"),
+        touch (A, "file"),
+        {ok, P} = einotify:new (),
+        {ok, Id} = einotify:add_tree (P, Dir, [create]),
+        {Entries, Done} = crawl_entries (Id, []),
+        ?assertEqual (#einotify_crawl_done{id = Id, watched = 4, failed = 0}, Done),
+        ?assertEqual (lists:sort ([Dir, A, B, C]),
+                      lists:sort ([Path || {_Wd, Path} <- Entries])),
+        {WdC, C} = lists:keyfind (C, 2, Entries),
+        touch (C, "f"),
+        ?assertMatch (#einotify{wd = WdC, mask = ?IN_CREATE, name = "f"}, next ()),
+        ok = einotify:close (P)
+    end).
+
+%% Crawled directories count against the watch budget.
+add_tree_budget (Dir) ->
+    ?_test (begin
+        E = subdir (Dir, "e"),
+        T = subdir (Dir, "t"),
+        subdir (T, "s"),
+        {ok, P} = einotify:new ([{watch_budget, 2}]),
+        {ok, WdE} = einotify:add_watch (P, E, [create], [evictable]),
+        {ok, Id} = einotify:add_tree (P, T, [create]),
+        {_Entries, Done} = crawl_entries (Id, []),
+        ?assertEqual (#einotify_crawl_done{id = Id, watched = 2, failed = 0}, Done),
+        ?assertEqual (#einotify_evicted{wd = WdE, path = E, reason = limit},
+                      receive #einotify_evicted{} = Ev -> Ev after ?wait -> timeout end),
+        {ok, Stats} = einotify:stats (P),
+        ?assertEqual (2, proplists:get_value (watches, Stats)),
+        ok = einotify:close (P)
+    end).
+
+%% Rewriting a file with the same content is suppressed.
+hash (Dir) ->
+    ?_test (begin
+        {ok, P} = einotify:new (),
+        {ok, Wd} = einotify:add_watch (P, Dir, [close_write], [hash]),
+        write (Dir, "f", "a"),
+        ?assertMatch (#einotify{wd = Wd, mask = ?IN_CLOSE_WRITE}, next ()),
+        write (Dir, "f", "a"),
+        ?assertEqual (timeout, next (?quiet)),
+        write (Dir, "f", "b"),
+        ?assertMatch (#einotify{wd = Wd, mask = ?IN_CLOSE_WRITE}, next ()),
+        ok = einotify:close (P)
+    end).
+
+%% A change seen through two watches is reported on both.
+hash_two_watches (Dir) ->
+    ?_test (begin
+        F = filename:join (Dir, "f"),
+        write (Dir, "f", ""),
+        {ok, P} = einotify:new (),
+        {ok, WdD} = einotify:add_watch (P, Dir, [close_write], [hash]),
+        {ok, WdF} = einotify:add_watch (P, F, [close_write], [hash]),
+        write (Dir, "f", "a"),
+        Wds = [Wd || #einotify{wd = Wd, mask = ?IN_CLOSE_WRITE} <- [next (), next ()]],
+        ?assertEqual (lists:sort ([WdD, WdF]), lists:sort (Wds)),
+        write (Dir, "f", "a"),
+        ?assertEqual (timeout, next (?quiet)),
+        ok = einotify:close (P)
+    end).
+
+%% Events carry the stat of their path.
+stat (Dir) ->
+    ?_test (begin
+        {ok, P} = einotify:new (),
+        {ok, _} = einotify:add_watch (P, Dir, [close_write], [stat]),
+        write (Dir, "f", "abc"),
+        ?assertMatch (#einotify{stat = #einotify_stat{type = regular, size = 3}}, next ()),
+        ok = einotify:close (P)
+    end).
+
+%% Events in order with the io_uring engine (epoll where unsupported).
+uring (Dir) ->
+    ?_test (begin
+        {ok, P} = einotify:new ([{engine, uring}]),
+        {ok, Wd} = einotify:add_watch (P, Dir, [create, delete]),
+        [touch (Dir, "f" ++ integer_to_list (I)) || I <- lists:seq (1, 100)],
+        Names = [Name || #einotify{wd = W, mask = ?IN_CREATE, name = Name} <- next_n (100),
+                         W =:= Wd],
+        ?assertEqual (["f" ++ integer_to_list (I) || I <- lists:seq (1, 100)], Names),
+        ok = einotify:rm_watch (P, Wd),
+        ?assertMatch (#einotify{wd = Wd, mask = ?IN_IGNORED}, next ()),
+        ok = einotify:close (P)
+    end).
+
+%% Under backlog high priority events are written first.
+priority (Dir) ->
+    ?_test (begin
+        Low = subdir (Dir, "low"),
+        High = subdir (Dir, "high"),
+        {ok, P} = einotify:new ([{active, 0}]),
+        ?assertEqual ({einotify_passive, P}, next ()),
+        {ok, WdL} = einotify:add_watch (P, Low, [create], [{priority, low}]),
+        {ok, WdH} = einotify:add_watch (P, High, [create], [{priority, high}]),
+        touch (Low, "l1"),
+        touch (Low, "l2"),
+        touch (High, "h1"),
+        timer:sleep (?quiet),
+        ok = einotify:active (P, true),
+        ?assertMatch (#einotify{wd = WdH, name = "h1"}, next ()),
+        ?assertMatch (#einotify{wd = WdL, name = "l1"}, next ()),
+        ?assertMatch (#einotify{wd = WdL, name = "l2"}, next ()),
+        ok = einotify:close (P)
+    end).
+
+%% Events above the rate are replaced by a summary.
+rate (Dir) ->
+    ?_test (begin
+        {ok, P} = einotify:new (),
+        {ok, Wd} = einotify:add_watch (P, Dir, [create], [{rate, 1}, {burst, 1}]),
+        [touch (Dir, "f" ++ integer_to_list (I)) || I <- lists:seq (1, 5)],
+        ?assertMatch (#einotify{wd = Wd, mask = ?IN_CREATE}, next ()),
+        #einotify_summary{wd = Wd, counts = Counts, names = Names} = next (),
+        ?assertEqual ([{?IN_CREATE, 4}], Counts),
+        ?assertEqual (4, length (Names)),
+        ok = einotify:close (P)
+    end).
+
+%% Tunables are checked on the command line and at run time.
+tunables (_Dir) ->
+    ?_test (begin
+        {ok, P} = einotify:new ([{batch, 1}, {sbuf, 4096}, {log_level, warning}]),
+        ?assertEqual (ok, einotify:set_opt (P, batch, 64)),
+        ?assertEqual (ok, einotify:set_opt (P, write_max, 4096)),
+        ?assertEqual ({error, badarg}, einotify:set_opt (P, rbuf, 1)),
+        ?assertEqual ({error, badarg}, einotify:set_opt (P, log_level, loud)),
+        ?assertEqual ({error, badarg}, einotify:set_opt (P, unknown, 1)),
+        ok = einotify:close (P)
+    end).
+
+%% An evictable watch makes room for a new one above the budget.
+budget (Dir) ->
+    ?_test (begin
+        A = subdir (Dir, "a"),
+        B = subdir (Dir, "b"),
+        {ok, P} = einotify:new ([{watch_budget, 1}]),
+        {ok, WdA} = einotify:add_watch (P, A, [create], [evictable]),
+        {ok, _}   = einotify:add_watch (P, B, [create]),
+        ?assertEqual (#einotify_evicted{wd = WdA, path = A, reason = limit}, next ()),
+        ?assertMatch (#einotify{wd = WdA, mask = ?IN_IGNORED}, next ()),
+        ok = einotify:close (P)
+    end).
+
+%% A polled watch reports the changes found by its scans.
+poll (Dir) ->
+    ?_test (begin
+        {ok, P} = einotify:new (),
+        {ok, Wd} = einotify:add_watch (P, Dir, [create, delete],
+                                       [poll, {poll_interval, 100}]),
+        ?assert (Wd < 0),
+        ?assertEqual ({error, 22}, einotify:add_watch (P, Dir, [create], [poll, hash])),
+        timer:sleep (?quiet), % after the baseline scan
+        touch (Dir, "f"),
+        ?assertMatch (#einotify{wd = Wd, mask = ?IN_CREATE, name = "f"}, next ()),
+        ok = einotify:close (P)
+    end).
+
+%% The snapshot of a directory comes before any live event of the watch.
+snapshot (Dir) ->
+    ?_test (begin
+        Names = ["f" ++ integer_to_list (I) || I <- lists:seq (1, 1000)],
+        [touch (Dir, Name) || Name <- Names],
+        {ok, P} = einotify:new (),
+        {ok, Wd} = einotify:add_watch (P, Dir, [create], [snapshot]),
+        touch (Dir, "new"),
+        {Entries, Next} = snapshot_entries (Wd, []),
+        %% "new" may be in the snapshot as well
+        ?assertEqual (lists:sort (Names),
+                      lists:sort ([Name || {?IN_CREATE, Name} <- Entries] -- ["new"])),
+        ?assertMatch (#einotify{wd = Wd, mask = ?IN_CREATE, name = "new"}, Next),
+        ok = einotify:close (P)
+    end).
+
+%% Recorded events are sent again from the requested sequence number.
+replay (Dir) ->
+    ?_test (begin
+        {ok, P} = einotify:new (),
+        {ok, _} = einotify:add_watch (P, Dir, [create]),
+        touch (Dir, "a"),
+        touch (Dir, "b"),
+        #einotify{name = "a", seq = Seq} = next (),
+        #einotify{name = "b", seq = Last} = next (),
+        ?assertEqual (Seq + 1, Last),
+        ?assertEqual ({ok, Last}, einotify:replay (P, Seq)),
+        ?assertMatch (#einotify{name = "b", seq = Last}, next ()),
+        ?assertEqual (timeout, next (?quiet)),
+        ok = einotify:set_opt (P, history, 0),
+        ?assertMatch ({error, {out_of_window, _}}, einotify:replay (P, 0)),
+        ok = einotify:close (P)
+    end).
+
+%% Repeated low priority events are coalesced in a backlog (the sequence
+%% numbers differ).
+coalesce (Dir) ->
+    ?_test (begin
+        {ok, P} = einotify:new ([{active, 0}, {coalesce, 0}]),
+        ?assertEqual ({einotify_passive, P}, next ()),
+        {ok, _} = einotify:add_watch (P, Dir, [modify], [{priority, low}]),
+        {ok, F} = file:open (filename:join (Dir, "f"), [write, raw]),
+        [begin ok = file:write (F, "x"), timer:sleep (2) end || _ <- lists:seq (1, 50)],
+        ok = file:close (F),
+        timer:sleep (?quiet),
+        {ok, Stats} = einotify:stats (P),
+        ?assert (proplists:get_value (coalesced, Stats) > 0),
+        ok = einotify:close (P)
+    end).
+
+%% Commands sent back to back are answered in order.
+pipeline (Dir) ->
+    ?_test (begin
+        {ok, P} = einotify:new (),
+        Self = self (),
+        Subs = [subdir (Dir, integer_to_list (I)) || I <- lists:seq (1, 50)],
+        [spawn_link (fun () -> Self ! {added, S, einotify:add_watch (P, S, [create])} end)
+         || S <- Subs],
+        Wds = [receive {added, S, {ok, Wd}} -> Wd after ?wait -> timeout end || S <- Subs],
+        ?assert (lists:all (fun erlang:is_integer/1, Wds)),
+        ?assertEqual (50, length (lists:usort (Wds))),
+        ok = einotify:close (P)
+    end).
+
+%% A command larger than rbuf is refused, the following ones are handled.
+oversized (Dir) ->
+    ?_test (begin
+        {ok, P} = einotify:new ([{rbuf, 1024}]),
+        Long = filename:join (Dir, lists:duplicate (2000, $x)),
+        ?assertEqual ({error, badarg}, einotify:add_watch (P, Long, [create])),
+        {ok, Wd} = einotify:add_watch (P, Dir, [create]),
+        touch (Dir, "f"),
+        ?assertMatch (#einotify{wd = Wd, name = "f"}, next ()),
+        ok = einotify:close (P)
+    end).
+
+%% N credits give N events and then the passive message.
+credits (Dir) ->
+    ?_test (begin
+        {ok, P} = einotify:new ([{active, 0}]),
+        ?assertEqual ({einotify_passive, P}, next ()),
+        {ok, _} = einotify:add_watch (P, Dir, [create]),
+        [touch (Dir, "f" ++ integer_to_list (I)) || I <- lists:seq (1, 3)],
+        ?assertEqual (timeout, next (?quiet)),
+        ok = einotify:active (P, 2),
+        ?assertMatch (#einotify{name = "f1"}, next ()),
+        ?assertMatch (#einotify{name = "f2"}, next ()),
+        ?assertEqual ({einotify_passive, P}, next ()),
+        ok = einotify:active (P, true),
+        ?assertMatch (#einotify{name = "f3"}, next ()),
+        ok = einotify:close (P)
+    end).
+
+%% Watches keep their descriptors and no events are lost across an upgrade.
+upgrade (Dir) ->
+    ?_test (begin
+        {ok, P} = einotify:new (),
+        {ok, Wd} = einotify:add_watch (P, Dir, [create]),
+        touch (Dir, "before"),
+        ok = einotify:upgrade (P),
+        touch (Dir, "after"),
+        ?assertMatch (#einotify{wd = Wd, name = "before"}, next ()),
+        ?assertMatch (#einotify{wd = Wd, name = "after"}, next ()),
+        {ok, Stats} = einotify:stats (P),
+        ?assertEqual (1, proplists:get_value (watches, Stats)),
+        ok = einotify:close (P)
+    end).
+
+%% A new port re-adds the watches and tells which paths changed meanwhile.
+checkpoint (Dir) ->
+    ?_test (begin
+        File = filename:join (Dir, "ckpt"),
+        Same = subdir (Dir, "same"),
+        Changed = subdir (Dir, "changed"),
+        P = checkpoint_new (File, []),
+        {ok, _} = einotify:add_watch (P, Same, [create]),
+        {ok, _} = einotify:add_watch (P, Changed, [create]),
+        checkpoint_close (P),
+        timer:sleep (1100), % mtime granularity of some file systems
+        touch (Changed, "f"),
+        P2 = checkpoint_new (File, [{Same, false}, {Changed, true}]),
+        checkpoint_close (P2)
+    end).
+
+%% A torn record at the end of the checkpoint is ignored.
+checkpoint_torn (Dir) ->
+    ?_test (begin
+        File = filename:join (Dir, "ckpt"),
+        Sub = subdir (Dir, "sub"),
+        P = checkpoint_new (File, []),
+        {ok, _} = einotify:add_watch (P, Sub, [create]),
+        checkpoint_close (P),
+        ok = file:write_file (File, <<64, 0, 0, 0, 1>>, [append]),
+        P2 = checkpoint_new (File, [{Sub, false}]),
+        {ok, Wd} = einotify:add_watch (P2, Sub, [create]),
+        touch (Sub, "f"),
+        ?assertMatch (#einotify{wd = Wd, name = "f"}, next ()),
+        checkpoint_close (P2)
+    end).
+
+
+%%==============================================================================
+%% Daemon tests
+%%==============================================================================
+
+%% Clients share the watch but get events as their own options say.
+daemon_share ({Dir, Sock, _}) ->
+    ?_test (begin
+        A = client (Sock, a, []),
+        B = client (Sock, b, []),
+        {ok, Wd} = einotify:add_watch (A, Dir, [create, close_write]),
+        ?assertEqual ({ok, Wd}, einotify:add_watch (B, Dir, [create, oneshot], [stat])),
+        write (Dir, "f", "x"),
+        ?assertMatch (#einotify{wd = Wd, mask = ?IN_CREATE, stat = undefined}, next (a)),
+        ?assertMatch (#einotify{wd = Wd, mask = ?IN_CLOSE_WRITE}, next (a)),
+        ?assertMatch (#einotify{wd = Wd, mask = ?IN_CREATE, stat = #einotify_stat{}},
+                      next (b)),
+        ?assertMatch (#einotify{wd = Wd, mask = ?IN_IGNORED, seq = 0}, next (b)),
+        touch (Dir, "g"),
+        ?assertMatch (#einotify{wd = Wd, mask = ?IN_CREATE, name = "g"}, next (a)),
+        ?assertMatch (#einotify{wd = Wd, mask = ?IN_CLOSE_WRITE, name = "g"}, next (a)),
+        ?assertEqual (timeout, next (b, ?quiet)),
+        ok = einotify:close (B),
+        ok = einotify:close (A)
+    end).
+
+%% Only the per client tunables are accepted.
+daemon_options ({_Dir, Sock, _}) ->
+    ?_test (begin
+        ?assertEqual ({error, badarg},
+                      einotify:new ([persistent, {daemon, Sock}, {batch, 5}])),
+        {ok, A} = einotify:new ([{daemon, Sock}, {write_max, 4096}]),
+        ?assertEqual ({error, badarg}, einotify:set_opt (A, history, 0)),
+        ?assertEqual (ok, einotify:set_opt (A, coalesce, 0)),
+        ?assertEqual ({error, badarg}, einotify:upgrade (A)),
+        ok = einotify:close (A)
+    end).
+
+%% A passive client falling behind loses its backlog, the others get all.
+daemon_overflow ({Dir, Sock, _}) ->
+    {timeout, 60, ?_test (begin
+        N = 30000,
+        A = client (Sock, a, [{active, 0}]),
+        ?assertEqual ({einotify_passive, A}, next (a)),
+        B = client (Sock, b, []),
+        {ok, Wd} = einotify:add_watch (A, Dir, [create]),
+        {ok, Wd} = einotify:add_watch (B, Dir, [create]),
+        [touch (Dir, integer_to_list (I)) || I <- lists:seq (1, N)],
+        ?assertEqual (N, count (b, Wd, 0)),
+        {ok, Stats} = einotify:stats (A),
+        ?assert (proplists:get_value (overflowed, Stats) >= 1),
+        ok = einotify:active (A, 1),
+        ?assertMatch (#einotify{wd = -1, mask = ?IN_Q_OVERFLOW, seq = 0}, next (a)),
+        ok = einotify:close (B),
+        ok = einotify:close (A)
+    end)}.
+
+
+%%==============================================================================
+%% Helpers
+%%==============================================================================
+
+tmp_dir () ->
+    filename:join ("/tmp", "einotify_tests-" ++ os:getpid () ++ "-"
+                   ++ integer_to_list (erlang:unique_integer ([positive]))).
+
+port () ->
+    Priv = case code:priv_dir (einotify) of
+               {error, _} -> "priv";
+               D          -> D
+           end,
+    filename:join (Priv, "einotify").
+
+subdir (Dir, Name) ->
+    Sub = filename:join (Dir, Name),
+    ok = file:make_dir (Sub),
+    Sub.
+
+touch (Dir, Name) ->
+    write (Dir, Name, "").
+
+write (Dir, Name, Data) ->
+    ok = file:write_file (filename:join (Dir, Name), Data).
+
+wait_for (Path) ->
+    wait_for (Path, 50).
+
+wait_for (Path, 0) ->
+    error ({not_created, Path});
+wait_for (Path, N) ->
+    case filelib:is_file (Path) of
+        true  -> ok;
+        false -> timer:sleep (20), wait_for (Path, N - 1)
+    end.
+
+next () ->
+    next (?wait).
+
+next (Timeout) when is_integer (Timeout) ->
+    receive Msg -> Msg after Timeout -> timeout end;
+next (Tag) ->
+    next (Tag, ?wait).
+
+%% Next message of the daemon client tagged Tag.
+next (Tag, Timeout) ->
+    receive {Tag, Msg} -> Msg after Timeout -> timeout end.
+
+%% Collects N messages.
+next_n (N) ->
+    [next () || _ <- lists:seq (1, N)].
+
+%% Collects the crawl results until the crawl is done.
+crawl_entries (Id, Acc) ->
+    receive
+        #einotify_crawl{id = Id, entries = Entries} -> crawl_entries (Id, Acc ++ Entries);
+        #einotify_crawl_done{id = Id} = Done        -> {Acc, Done}
+    after ?wait ->
+        {Acc, timeout}
+    end.
+
+%% Collects the snapshot chunks of the watch, returns them with the message
+%% that follows the last one.
+snapshot_entries (Wd, Acc) ->
+    case next () of
+        #einotify_snapshot{wd = Wd, entries = Entries, last = false} ->
+            snapshot_entries (Wd, Acc ++ Entries);
+        #einotify_snapshot{wd = Wd, entries = Entries, last = true} ->
+            {Acc ++ Entries, next ()}
+    end.
+
+%% Counts the events of the watch until none come.
+count (Tag, Wd, N) ->
+    receive
+        {Tag, #einotify{wd = Wd, mask = ?IN_CREATE}} -> count (Tag, Wd, N + 1)
+    after ?wait ->
+        N
+    end.
+
+%% Connects a daemon client owned by a process relaying its messages tagged
+%% with Tag (so that the messages of clients can be told apart).
+client (Sock, Tag, Opts) ->
+    Self = self (),
+    spawn_link (fun () ->
+                    {ok, C} = einotify:new ([{daemon, Sock} | Opts]),
+                    monitor (process, C),
+                    Self ! {Tag, {started, C}},
+                    relay (Tag, Self)
+                end),
+    {started, C} = next (Tag),
+    C.
+
+relay (Tag, To) ->
+    receive
+        {'DOWN', _Ref, process, _C, _Reason} ->
+            ok;
+        Msg ->
+            To ! {Tag, Msg},
+            relay (Tag, To)
+    end.
+
+%% Starts a checkpointed port and checks the restored watches.
+checkpoint_new (File, Expected) ->
+    {ok, P} = einotify:new ([{checkpoint, File}]),
+    #einotify_restored{entries = Entries, last = true} = next (),
+    ?assertEqual (lists:sort (Expected),
+                  lists:sort ([{Path, Changed} || {_Wd, Path, Changed} <- Entries])),
+    P.
+
+%% Closes the port and waits until it wrote out the checkpoint and exited.
+checkpoint_close (P) ->
+    Ref = monitor (process, P),
+    ok = einotify:close (P),
+    receive {'DOWN', Ref, process, P, _} -> ok end,
+    timer:sleep (?quiet).